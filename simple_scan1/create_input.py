@@ -1,6 +1,52 @@
-import sys, random, numpy
+import sys, random, numpy, struct, gzip, subprocess, zlib
 
 n = int(sys.argv[1])
+binary = "--binary" in sys.argv[2:]
+# Compressed inputs get a .gz or .zst suffix; the benchmark program
+# decompresses them while parsing.
+compression = "gzip" if "--gzip" in sys.argv[2:] else \
+              "zstd" if "--zstd" in sys.argv[2:] else None
+# Results are checked by digest; the full expected output is only
+# written on request.
+full_output = "--full-output" in sys.argv[2:]
+
+def binary_header(arr):
+    # 'b', format version 2, rank 1, element type, then the shape.
+    return "b" + struct.pack("<bb4s", 2, 1, " i32") + struct.pack("<Q", len(arr))
+
+def write_binary(f, arr):
+    # The header, then the little-endian elements.
+    f.write(binary_header(arr))
+    f.write(arr.astype("<i4").tostring())
+
+def digest(arr):
+    # CRC-32 of the array in the binary format, as printed by the
+    # benchmark program with --digest.  The elements wrap around like
+    # the program's 32-bit integers.
+    crc = zlib.crc32(binary_header(arr))
+    crc = zlib.crc32(arr.astype("<i4").tostring(), crc)
+    return "%08x" % (crc & 0xffffffff)
+
+class ZstdFile(object):
+    # Writes through the zstd command, as Python 2 has no zstd module.
+    def __init__(self, path):
+        self.proc = subprocess.Popen(["zstd", "-q", "-f", "-o", path],
+                                     stdin=subprocess.PIPE)
+    def write(self, data):
+        self.proc.stdin.write(data)
+    def __enter__(self):
+        return self
+    def __exit__(self, *exc):
+        self.proc.stdin.close()
+        if self.proc.wait() != 0:
+            raise IOError("zstd failed")
+
+def open_input(path):
+    if compression == "gzip":
+        return gzip.open(path + ".gz", "wb")
+    if compression == "zstd":
+        return ZstdFile(path + ".zst")
+    return open(path, "wb" if binary else "w")
 
 # inp = [random.randint(0,100) for i in range(n)]
 inp = numpy.random.randint(0, 100, size=n)
@@ -11,9 +57,16 @@ plus10 = map10(inp)
 print "Completed map."
 outp = numpy.cumsum(plus10)
 print "Completed scan. Writing input."
-with  open("data/simple_scan1_size_" + str(n) + ".input", "w") as f:
-    f.write(str(inp.tolist()))
-print "Wrote input. Writing output"
-with  open("data/simple_scan1_size_" + str(n) + ".output", "w") as f:
-    f.write(str(outp.tolist()))    
+with  open_input("data/simple_scan1_size_" + str(n) + ".input") as f:
+    if binary:
+        write_binary(f, inp)
+    else:
+        f.write(str(inp.tolist()))
+print "Wrote input. Writing digest"
+with  open("data/simple_scan1_size_" + str(n) + ".digest", "w") as f:
+    f.write(digest(outp) + "\n")
+if full_output:
+    print "Writing output"
+    with  open("data/simple_scan1_size_" + str(n) + ".output", "w") as f:
+        f.write(str(outp.tolist()))    
 print "Done!"
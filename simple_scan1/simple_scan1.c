@@ -7,6 +7,21 @@
 #include <errno.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#endif
+#include <zlib.h>
+#ifdef FUTHARK_ZSTD
+#include <zstd.h>
+#endif
 /* Crash and burn. */
 
 #include <stdarg.h>
@@ -77,6 +92,11 @@ static size_t cl_group_size = 256;
 static size_t cl_num_groups = 128;
 static size_t cl_lockstep_width = 1;
 
+// Whether the kernels index with 64-bit rather than 32-bit integers,
+// which is only needed for arrays of 2 GiB and more.
+static int cl_index64 = 0;
+static cl_device_id fut_cl_device;
+
 struct opencl_device_option {
   cl_platform_id platform;
   cl_device_id device;
@@ -91,6 +111,15 @@ struct opencl_device_option {
    constants based on the selected platform and device. */
 static void post_opencl_setup(struct opencl_device_option*);
 
+/* Chooses zero-copy buffers for devices that share memory with the
+   host.  Called by post_opencl_setup(). */
+static void setup_zero_copy(struct opencl_device_option*);
+
+/* Chooses between the single-pass and the multi-pass scan, and the
+   single-pass kernel for the device type.  Called by
+   post_opencl_setup() once the lockstep width is known. */
+static void setup_single_pass_scan(struct opencl_device_option*);
+
 static char *strclone(const char *str) {
   size_t size = strlen(str) + 1;
   char *copy = malloc(size);
@@ -337,6 +366,8 @@ static cl_build_status build_opencl_program(cl_program program, cl_device_id dev
   return build_status;
 }
 
+static cl_program load_opencl_program(const char *prelude_src, const char *src);
+
 static cl_program setup_opencl(const char *prelude_src, const char *src) {
 
   cl_int error;
@@ -353,6 +384,7 @@ static cl_program setup_opencl(const char *prelude_src, const char *src) {
 
   device = device_option.device;
   platform = device_option.platform;
+  fut_cl_device = device;
 
   OPENCL_SUCCEED(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
                                  sizeof(size_t), &max_group_size, NULL));
@@ -372,12 +404,24 @@ static cl_program setup_opencl(const char *prelude_src, const char *src) {
   fut_cl_context = clCreateContext(properties, 1, &device, NULL, NULL, &error);
   assert(error == 0);
 
-  fut_cl_queue = clCreateCommandQueue(fut_cl_context, device, 0, &error);
+  // Profiling lets debugging output report device-side transfer times.
+  fut_cl_queue = clCreateCommandQueue(fut_cl_context, device,
+                                      cl_debug ? CL_QUEUE_PROFILING_ENABLE : 0,
+                                      &error);
   assert(error == 0);
 
   /* Make sure this function is defined. */
   post_opencl_setup(&device_option);
 
+  return load_opencl_program(prelude_src, src);
+}
+
+/* Builds the OpenCL program for the device chosen by setup_opencl().
+   The kernels index with the type index_t, which is int or long
+   depending on cl_index64. */
+static cl_program load_opencl_program(const char *prelude_src, const char *src) {
+  cl_int error;
+
   // Build the OpenCL program.  First we have to prepend the prelude to the program source.
   size_t prelude_size = strlen(prelude_src);
   size_t program_size = strlen(src);
@@ -393,95 +437,543 @@ static cl_program setup_opencl(const char *prelude_src, const char *src) {
   prog = clCreateProgramWithSource(fut_cl_context, 1, src_ptr, &src_size, &error);
   assert(error == 0);
   char compile_opts[1024];
-  snprintf(compile_opts, sizeof(compile_opts), "-DFUT_BLOCK_DIM=%d -DLOCKSTEP_WIDTH=%d", FUT_BLOCK_DIM, cl_lockstep_width);
-  OPENCL_SUCCEED(build_opencl_program(prog, device, compile_opts));
+  snprintf(compile_opts, sizeof(compile_opts), "-DFUT_BLOCK_DIM=%d -DLOCKSTEP_WIDTH=%d -DFUT_INDEX_T=%s",
+           FUT_BLOCK_DIM, cl_lockstep_width, cl_index64 ? "long" : "int");
+  OPENCL_SUCCEED(build_opencl_program(prog, fut_cl_device, compile_opts));
   free(fut_opencl_src);
 
   return prog;
 }
 
-static const char fut_opencl_prelude[] =
-                  "typedef char int8_t;\ntypedef short int16_t;\ntypedef int int32_t;\ntypedef long int64_t;\ntypedef uchar uint8_t;\ntypedef ushort uint16_t;\ntypedef uint uint32_t;\ntypedef ulong uint64_t;\nstatic inline int8_t add8(int8_t x, int8_t y)\n{\n    return x + y;\n}\nstatic inline int16_t add16(int16_t x, int16_t y)\n{\n    return x + y;\n}\nstatic inline int32_t add32(int32_t x, int32_t y)\n{\n    return x + y;\n}\nstatic inline int64_t add64(int64_t x, int64_t y)\n{\n    return x + y;\n}\nstatic inline int8_t sub8(int8_t x, int8_t y)\n{\n    return x - y;\n}\nstatic inline int16_t sub16(int16_t x, int16_t y)\n{\n    return x - y;\n}\nstatic inline int32_t sub32(int32_t x, int32_t y)\n{\n    return x - y;\n}\nstatic inline int64_t sub64(int64_t x, int64_t y)\n{\n    return x - y;\n}\nstatic inline int8_t mul8(int8_t x, int8_t y)\n{\n    return x * y;\n}\nstatic inline int16_t mul16(int16_t x, int16_t y)\n{\n    return x * y;\n}\nstatic inline int32_t mul32(int32_t x, int32_t y)\n{\n    return x * y;\n}\nstatic inline int64_t mul64(int64_t x, int64_t y)\n{\n    return x * y;\n}\nstatic inline uint8_t udiv8(uint8_t x, uint8_t y)\n{\n    return x / y;\n}\nstatic inline uint16_t udiv16(uint16_t x, uint16_t y)\n{\n    return x / y;\n}\nstatic inline uint32_t udiv32(uint32_t x, uint32_t y)\n{\n    return x / y;\n}\nstatic inline uint64_t udiv64(uint64_t x, uint64_t y)\n{\n    return x / y;\n}\nstatic inline uint8_t umod8(uint8_t x, uint8_t y)\n{\n    return x % y;\n}\nstatic inline uint16_t umod16(uint16_t x, uint16_t y)\n{\n    return x % y;\n}\nstatic inline uint32_t umod32(uint32_t x, uint32_t y)\n{\n    return x % y;\n}\nstatic inline uint64_t umod64(uint64_t x, uint64_t y)\n{\n    return x % y;\n}\nstatic inline int8_t sdiv8(int8_t x, int8_t y)\n{\n    int8_t q = x / y;\n    int8_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int16_t sdiv16(int16_t x, int16_t y)\n{\n    int16_t q = x / y;\n    int16_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int32_t sdiv32(int32_t x, int32_t y)\n{\n    int32_t q = x / y;\n    int32_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int64_t sdiv64(int64_t x, int64_t y)\n{\n    int64_t q = x / y;\n    int64_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int8_t smod8(int8_t x, int8_t y)\n{\n    int8_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int16_t smod16(int16_t x, int16_t y)\n{\n    int16_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int32_t smod32(int32_t x, int32_t y)\n{\n    int32_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int64_t smod64(int64_t x, int64_t y)\n{\n    int64_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int8_t squot8(int8_t x, int8_t y)\n{\n    return x / y;\n}\nstatic inline int16_t squot16(int16_t x, int16_t y)\n{\n    return x / y;\n}\nstatic inline int32_t squot32(int32_t x, int32_t y)\n{\n    return x / y;\n}\nstatic inline int64_t squot64(int64_t x, int64_t y)\n{\n    return x / y;\n}\nstatic inline int8_t srem8(int8_t x, int8_t y)\n{\n    return x % y;\n}\nstatic inline int16_t srem16(int16_t x, int16_t y)\n{\n    return x % y;\n}\nstatic inline int32_t srem32(int32_t x, int32_t y)\n{\n    return x % y;\n}\nstatic inline int64_t srem64(int64_t x, int64_t y)\n{\n    return x % y;\n}\nstatic inline uint8_t shl8(uint8_t x, uint8_t y)\n{\n    return x << y;\n}\nstatic inline uint16_t shl16(uint16_t x, uint16_t y)\n{\n    return x << y;\n}\nstatic inline uint32_t shl32(uint32_t x, uint32_t y)\n{\n    return x << y;\n}\nstatic inline uint64_t shl64(uint64_t x, uint64_t y)\n{\n    return x << y;\n}\nstatic inline uint8_t lshr8(uint8_t x, uint8_t y)\n{\n    return x >> y;\n}\nstatic inline uint16_t lshr16(uint16_t x, uint16_t y)\n{\n    return x >> y;\n}\nstatic inline uint32_t lshr32(uint32_t x, uint32_t y)\n{\n    return x >> y;\n}\nstatic inline uint64_t lshr64(uint64_t x, uint64_t y)\n{\n    return x >> y;\n}\nstatic inline int8_t ashr8(int8_t x, int8_t y)\n{\n    return x >> y;\n}\nstatic inline int16_t ashr16(int16_t x, int16_t y)\n{\n    return x >> y;\n}\nstatic inline int32_t ashr32(int32_t x, int32_t y)\n{\n    return x >> y;\n}\nstatic inline int64_t ashr64(int64_t x, int64_t y)\n{\n    return x >> y;\n}\nstatic inline uint8_t and8(uint8_t x, uint8_t y)\n{\n    return x & y;\n}\nstatic inline uint16_t and16(uint16_t x, uint16_t y)\n{\n    return x & y;\n}\nstatic inline uint32_t and32(uint32_t x, uint32_t y)\n{\n    return x & y;\n}\nstatic inline uint64_t and64(uint64_t x, uint64_t y)\n{\n    return x & y;\n}\nstatic inline uint8_t or8(uint8_t x, uint8_t y)\n{\n    return x | y;\n}\nstatic inline uint16_t or16(uint16_t x, uint16_t y)\n{\n    return x | y;\n}\nstatic inline uint32_t or32(uint32_t x, uint32_t y)\n{\n    return x | y;\n}\nstatic inline uint64_t or64(uint64_t x, uint64_t y)\n{\n    return x | y;\n}\nstatic inline uint8_t xor8(uint8_t x, uint8_t y)\n{\n    return x ^ y;\n}\nstatic inline uint16_t xor16(uint16_t x, uint16_t y)\n{\n    return x ^ y;\n}\nstatic inline uint32_t xor32(uint32_t x, uint32_t y)\n{\n    return x ^ y;\n}\nstatic inline uint64_t xor64(uint64_t x, uint64_t y)\n{\n    return x ^ y;\n}\nstatic inline char ult8(uint8_t x, uint8_t y)\n{\n    return x < y;\n}\nstatic inline char ult16(uint16_t x, uint16_t y)\n{\n    return x < y;\n}\nstatic inline char ult32(uint32_t x, uint32_t y)\n{\n    return x < y;\n}\nstatic inline char ult64(uint64_t x, uint64_t y)\n{\n    return x < y;\n}\nstatic inline char ule8(uint8_t x, uint8_t y)\n{\n    return x <= y;\n}\nstatic inline char ule16(uint16_t x, uint16_t y)\n{\n    return x <= y;\n}\nstatic inline char ule32(uint32_t x, uint32_t y)\n{\n    return x <= y;\n}\nstatic inline char ule64(uint64_t x, uint64_t y)\n{\n    return x <= y;\n}\nstatic inline char slt8(int8_t x, int8_t y)\n{\n    return x < y;\n}\nstatic inline char slt16(int16_t x, int16_t y)\n{\n    return x < y;\n}\nstatic inline char slt32(int32_t x, int32_t y)\n{\n    return x < y;\n}\nstatic inline char slt64(int64_t x, int64_t y)\n{\n    return x < y;\n}\nstatic inline char sle8(int8_t x, int8_t y)\n{\n    return x <= y;\n}\nstatic inline char sle16(int16_t x, int16_t y)\n{\n    return x <= y;\n}\nstatic inline char sle32(int32_t x, int32_t y)\n{\n    return x <= y;\n}\nstatic inline char sle64(int64_t x, int64_t y)\n{\n    return x <= y;\n}\nstatic inline int8_t pow8(int8_t x, int8_t y)\n{\n    int8_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int16_t pow16(int16_t x, int16_t y)\n{\n    int16_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int32_t pow32(int32_t x, int32_t y)\n{\n    int32_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int64_t pow64(int64_t x, int64_t y)\n{\n    int64_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int8_t sext_i8_i8(int8_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i8_i16(int8_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i8_i32(int8_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i8_i64(int8_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i16_i8(int16_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i16_i16(int16_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i16_i32(int16_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i16_i64(int16_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i32_i8(int32_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i32_i16(int32_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i32_i32(int32_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i32_i64(int32_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i64_i8(int64_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i64_i16(int64_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i64_i32(int64_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i64_i64(int64_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i8_i8(uint8_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i8_i16(uint8_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i8_i32(uint8_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i8_i64(uint8_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i16_i8(uint16_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i16_i16(uint16_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i16_i32(uint16_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i16_i64(uint16_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i32_i8(uint32_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i32_i16(uint32_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i32_i32(uint32_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i32_i64(uint32_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i64_i8(uint64_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i64_i16(uint64_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i64_i32(uint64_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i64_i64(uint64_t x)\n{\n    return x;\n}\nstatic inline float fdiv32(float x, float y)\n{\n    return x / y;\n}\nstatic inline float fadd32(float x, float y)\n{\n    return x + y;\n}\nstatic inline float fsub32(float x, float y)\n{\n    return x - y;\n}\nstatic inline float fmul32(float x, float y)\n{\n    return x * y;\n}\nstatic inline float fpow32(float x, float y)\n{\n    return pow(x, y);\n}\nstatic inline char cmplt32(float x, float y)\n{\n    return x < y;\n}\nstatic inline char cmple32(float x, float y)\n{\n    return x <= y;\n}\nstatic inline float sitofp_i8_f32(int8_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i16_f32(int16_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i32_f32(int32_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i64_f32(int64_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i8_f32(uint8_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i16_f32(uint16_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i32_f32(uint32_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i64_f32(uint64_t x)\n{\n    return x;\n}\nstatic inline int8_t fptosi_f32_i8(float x)\n{\n    return x;\n}\nstatic inline int16_t fptosi_f32_i16(float x)\n{\n    return x;\n}\nstatic inline int32_t fptosi_f32_i32(float x)\n{\n    return x;\n}\nstatic inline int64_t fptosi_f32_i64(float x)\n{\n    return x;\n}\nstatic inline uint8_t fptoui_f32_i8(float x)\n{\n    return x;\n}\nstatic inline uint16_t fptoui_f32_i16(float x)\n{\n    return x;\n}\nstatic inline uint32_t fptoui_f32_i32(float x)\n{\n    return x;\n}\nstatic inline uint64_t fptoui_f32_i64(float x)\n{\n    return x;\n}\n";
-static const char fut_opencl_program[] = FUT_KERNEL(
-__kernel void map_kernel_52(__global unsigned char *a_mem_136, int32_t size_37,
-                            __global unsigned char *mem_138)
-{
-    const uint kernel_thread_index_52 = get_global_id(0);
-    
-    if (kernel_thread_index_52 >= size_37)
-        return;
-    
-    int32_t i_53;
-    int32_t binop_param_noncurried_54;
-    
-    // compute thread index
-    {
-        i_53 = kernel_thread_index_52;
+/* Sets a kernel argument of type index_t. */
+static cl_int set_index_kernel_arg(cl_kernel kernel, cl_uint arg_index, int64_t value) {
+  int32_t value32 = value;
+
+  if (cl_index64) {
+    return clSetKernelArg(kernel, arg_index, sizeof(value), &value);
+  } else {
+    return clSetKernelArg(kernel, arg_index, sizeof(value32), &value32);
+  }
+}
+
+/* Returns how many elements per thread scan_kernel_62 and
+   lookback_scan_kernel move through local memory at a time:
+   FUT_BLOCK_DIM, or fewer if the tiles of a work-group of group_size
+   threads, with their padding column, would take more than half the
+   local memory of the device. */
+static int32_t scan_tile_depth(int32_t group_size) {
+  static cl_ulong local_mem_size = 0;
+  int64_t depth;
+
+  if (local_mem_size == 0) {
+    OPENCL_SUCCEED(clGetDeviceInfo(fut_cl_device, CL_DEVICE_LOCAL_MEM_SIZE,
+                                   sizeof(local_mem_size), &local_mem_size, NULL));
+  }
+  // The scan of the per-thread sums takes one more element per thread.
+  depth = (int64_t)(local_mem_size / 2) / ((int64_t)sizeof(int32_t) * group_size) - 2;
+  if (depth > FUT_BLOCK_DIM) {
+    depth = FUT_BLOCK_DIM;
+  }
+  return depth < 1 ? 1 : depth;
+}
+
+/* Host memory.
+
+   Memory blocks are passed around by value, so the copies of a block
+   share its reference count through a pointer.  Instead of allocating
+   every count on its own with malloc(), refcount_new() carves them out
+   of slabs of REFCOUNT_SLAB_SIZE, and refcount_release() keeps released
+   ones on a free list for the next block.  After the first run,
+   futhark_main() then does no host allocation at all, and the counts
+   of the blocks alive at once share a few cache lines.
+
+   Host arrays are aligned to HOST_ALIGN bytes, or to a page if they
+   are at least HOST_PAGE_ALIGN_MIN bytes, which suits vector loads and
+   lets OpenCL implementations transfer from them without copying them
+   to an aligned buffer first.
+
+   On Linux, large host arrays can also be placed deliberately, before
+   their pages are first touched:
+
+   - With --huge-pages, arrays of at least HOST_HUGE_PAGE_SIZE bytes
+     are aligned to it and backed by transparent huge pages, so that
+     parsing, uploading and verifying them takes fewer page faults and
+     TLB misses.
+
+   - With --numa-interleave, their pages are spread over all the NUMA
+     nodes the program may use.  With --numa-node, they are placed on
+     the given node, and the program runs on the CPUs of that node,
+     as do the threads that the OpenCL runtime and the parser start.
+
+   - With --pin-cpu, the main thread is moreover pinned to a single
+     CPU once the input has been read, which leaves the parse threads
+     free to run elsewhere. */
+
+#define REFCOUNT_SLAB_SIZE 256
+#define HOST_ALIGN 64
+#define HOST_PAGE_ALIGN_MIN (64 * 1024)
+#define HOST_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HOST_MAX_NODES 1024
+#define HOST_MAX_CPUS 4096
+
+union refcount_cell {
+  int count;
+  union refcount_cell *next;    // When on the free list.
+};
+
+static union refcount_cell *refcount_free = NULL;
+static int64_t refcount_slabs = 0;
+
+static int *refcount_new() {
+  union refcount_cell *cell;
+
+  if (refcount_free == NULL) {
+    union refcount_cell *slab = malloc(REFCOUNT_SLAB_SIZE * sizeof(union refcount_cell));
+
+    if (slab == NULL) {
+      panic(1, "Cannot allocate reference counts.\n");
     }
-    // read kernel parameters
-    {
-        binop_param_noncurried_54 = *(__global int32_t *) &a_mem_136[i_53 * 4];
+    // Hand out the cells in address order.
+    for (int i = REFCOUNT_SLAB_SIZE - 1; i >= 0; i--) {
+      slab[i].next = refcount_free;
+      refcount_free = &slab[i];
     }
-    
-    int32_t res_55 = binop_param_noncurried_54 + 10;
-    
-    // write kernel result
-    {
-        *(__global int32_t *) &mem_138[i_53 * 4] = res_55;
-    }
-}
-__kernel void fut_kernel_map_transpose_i32(__global int32_t *odata,
-                                           uint odata_offset, __global
-                                           int32_t *idata, uint idata_offset,
-                                           uint width, uint height,
-                                           uint total_size, __local
-                                           int32_t *block)
-{
-    uint x_index;
-    uint y_index;
-    uint our_array_offset;
-    
-    // Adjust the input and output arrays with the basic offset.
-    odata += odata_offset / sizeof(int32_t);
-    idata += idata_offset / sizeof(int32_t);
-    // Adjust the input and output arrays for the third dimension.
-    our_array_offset = get_global_id(2) * width * height;
-    odata += our_array_offset;
-    idata += our_array_offset;
-    // read the matrix tile into shared memory
-    x_index = get_global_id(0);
-    y_index = get_global_id(1);
-    
-    uint index_in = y_index * width + x_index;
-    
-    if ((x_index < width && y_index < height) && index_in < total_size)
-        block[get_local_id(1) * (FUT_BLOCK_DIM + 1) + get_local_id(0)] =
-            idata[index_in];
-    barrier(CLK_LOCAL_MEM_FENCE);
-    // Write the transposed matrix tile to global memory.
-    x_index = get_group_id(1) * FUT_BLOCK_DIM + get_local_id(0);
-    y_index = get_group_id(0) * FUT_BLOCK_DIM + get_local_id(1);
-    
-    uint index_out = y_index * height + x_index;
-    
-    if ((x_index < height && y_index < width) && index_out < total_size)
-        odata[index_out] = block[get_local_id(0) * (FUT_BLOCK_DIM + 1) +
-                                 get_local_id(1)];
+    refcount_slabs++;
+  }
+  cell = refcount_free;
+  refcount_free = cell->next;
+  cell->count = 1;
+  return &cell->count;
+}
+
+static void refcount_release(int *count) {
+  union refcount_cell *cell = (union refcount_cell*) count;
+
+  cell->next = refcount_free;
+  refcount_free = cell;
+}
+
+static int huge_pages = 0;
+static int numa_interleave = 0;
+static int numa_node = -1;      // Negative means any node.
+static int pin_cpu = -1;        // Negative means any CPU.
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* Applies the placement options to the pages that lie wholly within
+   the size bytes at p.  Pages already touched stay where they are. */
+static void host_place(void *p, int64_t size) {
+#ifdef __linux__
+  long page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)p + page_size - 1) / page_size * page_size;
+  uintptr_t end = ((uintptr_t)p + size) / page_size * page_size;
+  unsigned long nodes[HOST_MAX_NODES / BITS_PER_WORD] = {0};
+  int mode;
+
+  if (size < HOST_PAGE_ALIGN_MIN || end <= start) {
+    return;
+  }
+  if (huge_pages) {
+    // Not an error if transparent huge pages are turned off.
+    madvise((void*)start, end - start, MADV_HUGEPAGE);
+  }
+  if (numa_interleave) {
+    if (syscall(SYS_get_mempolicy, NULL, nodes, HOST_MAX_NODES, NULL,
+                MPOL_F_MEMS_ALLOWED) != 0) {
+      return;
+    }
+    mode = MPOL_INTERLEAVE;
+  } else if (numa_node >= 0) {
+    nodes[numa_node / BITS_PER_WORD] |= 1UL << (numa_node % BITS_PER_WORD);
+    mode = MPOL_BIND;
+  } else {
+    return;
+  }
+  // The kernel reads one bit less than the number of nodes given.
+  if (syscall(SYS_mbind, start, end - start, mode, nodes, HOST_MAX_NODES + 1, 0) != 0 &&
+      cl_debug) {
+    fprintf(stderr, "Cannot place host memory: %s\n", strerror(errno));
+  }
+#else
+  (void) p;
+  (void) size;
+#endif
+}
+
+#ifdef __linux__
+/* Sets the bits of a list such as "0-3,8-11" in mask.  Returns
+   nonzero if the list is malformed. */
+static int parse_cpu_list(const char *list, unsigned long *mask) {
+  while (*list != '\0' && *list != '\n') {
+    char *end;
+    long first = strtol(list, &end, 10), last = first;
+
+    if (end == list) {
+      return 1;
+    }
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list) {
+        return 1;
+      }
+    }
+    for (long cpu = first; cpu <= last && cpu < HOST_MAX_CPUS; cpu++) {
+      mask[cpu / BITS_PER_WORD] |= 1UL << (cpu % BITS_PER_WORD);
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
+
+static void set_host_affinity(const unsigned long *mask, const char *what) {
+  if (syscall(SYS_sched_setaffinity, 0, HOST_MAX_CPUS / 8, mask) != 0) {
+    panic(1, "Cannot run on %s: %s\n", what, strerror(errno));
+  }
+}
+#endif
+
+/* Runs the program on the CPUs of the node given with --numa-node.
+   Threads started afterwards inherit this. */
+static void bind_host_threads() {
+#ifdef __linux__
+  unsigned long mask[HOST_MAX_CPUS / BITS_PER_WORD] = {0};
+  char path[64], list[4096], what[32];
+  FILE *f;
+
+  if (numa_node < 0) {
+    return;
+  }
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node);
+  snprintf(what, sizeof(what), "NUMA node %d", numa_node);
+  f = fopen(path, "r");
+  if (f == NULL || fgets(list, sizeof(list), f) == NULL || parse_cpu_list(list, mask) != 0) {
+    panic(1, "Cannot find the CPUs of %s.\n", what);
+  }
+  fclose(f);
+  set_host_affinity(mask, what);
+  if (cl_debug) {
+    fprintf(stderr, "Running on the CPUs of %s: %s", what, list);
+  }
+#endif
+}
+
+/* Pins the calling thread to the CPU given with --pin-cpu. */
+static void pin_host_thread() {
+#ifdef __linux__
+  unsigned long mask[HOST_MAX_CPUS / BITS_PER_WORD] = {0};
+  char what[32];
+
+  if (pin_cpu < 0) {
+    return;
+  }
+  mask[pin_cpu / BITS_PER_WORD] |= 1UL << (pin_cpu % BITS_PER_WORD);
+  snprintf(what, sizeof(what), "CPU %d", pin_cpu);
+  set_host_affinity(mask, what);
+  if (cl_debug) {
+    fprintf(stderr, "Pinned the main thread to %s.\n", what);
+  }
+#endif
+}
+
+/* Allocates size bytes of host memory, placed as asked for, to be
+   freed with free().  Returns NULL on failure. */
+static void *host_alloc(int64_t size) {
+  size_t align = HOST_ALIGN;
+  void *p;
+
+  if (size >= HOST_PAGE_ALIGN_MIN) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > HOST_ALIGN) {
+      align = page_size;
+    }
+  }
+  if (huge_pages && size >= HOST_HUGE_PAGE_SIZE) {
+    align = HOST_HUGE_PAGE_SIZE;
+  }
+  if (posix_memalign(&p, align, size > 0 ? size : 1) != 0) {
+    return NULL;
+  }
+  host_place(p, size);
+  return p;
+}
+
+/* Moves the first used bytes of p, which came from host_alloc() or is
+   NULL, to a new array of size bytes from host_alloc(), and frees p.
+   The new array is placed before anything is copied into it.  Returns
+   NULL on failure, leaving p as it was. */
+static void *host_grow(void *p, int64_t used, int64_t size) {
+  void *q = host_alloc(size);
+
+  if (q == NULL) {
+    return NULL;
+  }
+  if (p != NULL) {
+    memcpy(q, p, used < size ? used : size);
+    free(p);
+  }
+  return q;
+}
+
+/* Device buffer pool.
+
+   Every call of futhark_main() allocates its intermediate arrays anew
+   and releases them again before returning, and with --runs the same
+   sizes are asked for on every run.  Instead of going to the driver
+   each time, memblock_alloc_device() rounds the size up to a size
+   class, and memblock_unref_device() keeps a released buffer on a
+   free list from which a later request of the same class is served.
+   There are four size classes per power of two, so at most a quarter
+   of a buffer is wasted.  The free list holds at most
+   device_pool_limit bytes, releasing the longest-unused buffers first,
+   and is emptied before giving up when the driver cannot allocate a
+   new buffer.  A limit of zero turns the pool off.
+
+   futhark_main() releases each intermediate array as soon as the last
+   command reading it has been enqueued, rather than all of them at
+   the end (turned off with --no-memory-plan).  The command queue is
+   in order, so a buffer taken from the free list by a later
+   allocation is only written once those commands are done, and arrays
+   whose lifetimes do not overlap end up sharing a buffer.  This cuts
+   the peak device memory, which is reported with -s, from the input
+   and all its intermediate arrays at once to the input and two
+   arrays of its size. */
+
+static int64_t device_pool_limit = -1;   // Bytes; negative means no limit.
+static int memory_plan = 1;
+static cl_mem_flags device_pool_flags = CL_MEM_READ_WRITE;
+
+struct device_pool_entry {
+  cl_mem mem;
+  int64_t size;
+};
+
+// Ordered from the longest to the most recently released.
+static struct device_pool_entry *device_pool = NULL;
+static int device_pool_used = 0;
+static int device_pool_capacity = 0;
+static int64_t device_pool_bytes = 0;
+
+// Statistics, reported with -s.
+static int64_t device_pool_allocs = 0;   // Requests for a buffer.
+static int64_t device_pool_hits = 0;     // Requests served from the free list.
+static int64_t device_pool_creates = 0;  // Buffers created by the driver.
+static int64_t device_pool_trims = 0;    // Free lists emptied on failure.
+static int64_t device_pool_in_use = 0;   // Bytes handed out and not released.
+static int64_t device_pool_peak_in_use = 0;
+static int64_t device_pool_peak_held = 0; // Also counting the free list.
+
+static int64_t device_pool_size_class(int64_t size) {
+  int64_t step = 8;
+
+  if (size < 1) {
+    size = 1;
+  }
+  // The classes between p/2 and p, for a power of two p, are p/8 apart.
+  while (step * 8 < size) {
+    step *= 2;
+  }
+  return (size + step - 1) / step * step;
+}
+
+static void device_pool_remove(int i) {
+  device_pool_bytes -= device_pool[i].size;
+  device_pool_used--;
+  memmove(&device_pool[i], &device_pool[i+1],
+          (device_pool_used - i) * sizeof(struct device_pool_entry));
+}
+
+/* Releases the longest-unused buffers until at most limit bytes are
+   kept. */
+static void device_pool_trim(int64_t limit) {
+  while (device_pool_used > 0 && device_pool_bytes > limit) {
+    OPENCL_SUCCEED(clReleaseMemObject(device_pool[0].mem));
+    device_pool_remove(0);
+  }
 }
+
+static int device_pool_out_of_memory(cl_int error) {
+  return error == CL_MEM_OBJECT_ALLOCATION_FAILURE ||
+    error == CL_OUT_OF_RESOURCES || error == CL_OUT_OF_HOST_MEMORY;
+}
+
+static void device_pool_count(int64_t size) {
+  device_pool_in_use += size;
+  if (device_pool_in_use > device_pool_peak_in_use) {
+    device_pool_peak_in_use = device_pool_in_use;
+  }
+}
+
+/* Creates a buffer like clCreateBuffer(), but first empties the free
+   list and tries again if the driver is out of memory.  Also used for
+   the buffers that do not come from the pool. */
+static cl_mem device_pool_create(cl_mem_flags flags, int64_t size, cl_int *error) {
+  cl_mem mem = clCreateBuffer(fut_cl_context, flags, size, NULL, error);
+
+  if (device_pool_out_of_memory(*error) && device_pool_used > 0) {
+    if (cl_debug) {
+      fprintf(stderr, "Releasing %ld pooled bytes to allocate %ld bytes.\n",
+              (long)device_pool_bytes, (long)size);
+    }
+    device_pool_trim(0);
+    device_pool_trims++;
+    mem = clCreateBuffer(fut_cl_context, flags, size, NULL, error);
+  }
+  return mem;
+}
+
+/* Returns a buffer of at least size bytes, storing its actual size in
+   *size_out. */
+static cl_mem device_pool_alloc(int64_t size, int64_t *size_out) {
+  cl_int error;
+  cl_mem mem;
+
+  device_pool_allocs++;
+  if (device_pool_limit == 0) {
+    *size_out = size > 0 ? size : 1;
+  } else {
+    *size_out = device_pool_size_class(size);
+    for (int i = device_pool_used - 1; i >= 0; i--) {
+      if (device_pool[i].size == *size_out) {
+        mem = device_pool[i].mem;
+        device_pool_remove(i);
+        device_pool_hits++;
+        device_pool_count(*size_out);
+        return mem;
+      }
+    }
+  }
+
+  mem = device_pool_create(device_pool_flags, *size_out, &error);
+  // The size class may not fit where the size itself does.
+  if (device_pool_out_of_memory(error) && *size_out > size && size > 0) {
+    *size_out = size;
+    mem = clCreateBuffer(fut_cl_context, device_pool_flags, *size_out, NULL, &error);
+  }
+  OPENCL_SUCCEED(error);
+  device_pool_creates++;
+  device_pool_count(*size_out);
+  if (device_pool_in_use + device_pool_bytes > device_pool_peak_held) {
+    device_pool_peak_held = device_pool_in_use + device_pool_bytes;
+  }
+  return mem;
+}
+
+/* Puts a buffer obtained from device_pool_alloc() back on the free
+   list, or releases it if the pool cannot hold it. */
+static void device_pool_free(cl_mem mem, int64_t size) {
+  device_pool_in_use -= size;
+  if (device_pool_limit >= 0 && size > device_pool_limit) {
+    OPENCL_SUCCEED(clReleaseMemObject(mem));
+    return;
+  }
+  if (device_pool_used == device_pool_capacity) {
+    device_pool_capacity = device_pool_capacity * 2 + 16;
+    device_pool = realloc(device_pool,
+                          device_pool_capacity * sizeof(struct device_pool_entry));
+    if (device_pool == NULL) {
+      panic(1, "Cannot allocate the device buffer pool.\n");
+    }
+  }
+  device_pool[device_pool_used].mem = mem;
+  device_pool[device_pool_used].size = size;
+  device_pool_used++;
+  device_pool_bytes += size;
+  if (device_pool_limit >= 0) {
+    device_pool_trim(device_pool_limit);
+  }
+}
+
+static void report_device_pool() {
+  fprintf(stderr, "Device buffer pool: %ld allocations, %ld reused (%.1f%%), "
+          "%ld created, %ld emptied on failure; %ld bytes in %d buffers kept.\n",
+          (long)device_pool_allocs, (long)device_pool_hits,
+          device_pool_allocs == 0 ? 0.0 : 100.0 * device_pool_hits / device_pool_allocs,
+          (long)device_pool_creates, (long)device_pool_trims,
+          (long)device_pool_bytes, device_pool_used);
+  fprintf(stderr, "Peak device memory: %ld bytes in use, %ld bytes allocated%s.\n",
+          (long)device_pool_peak_in_use, (long)device_pool_peak_held,
+          memory_plan ? "" : " (without memory plan)");
+}
+
+/* Memory accounting.
+
+   The memory blocks count the bytes they hold on the host, as the
+   device buffer pool does on the device, and how often blocks are
+   allocated and released.  With --memory-report, or -s, every run
+   reports its peak device and host bytes in use, its allocations and
+   releases, and the high-water mark of the resident set size of the
+   process on stderr.  That gives the largest input a device can take
+   and shows churn in allocation.  The peaks are those of the run itself,
+   counting what was already held when it began. */
+
+static int memory_report = 0;
+static int64_t host_in_use = 0;
+static int64_t host_peak_in_use = 0;
+static int64_t memblock_allocs = 0;
+static int64_t memblock_frees = 0;
+
+struct memory_run {
+  // The peaks before the run, which are restored at its end.
+  int64_t device_peak;
+  int64_t host_peak;
+  int64_t allocs;
+  int64_t frees;
+};
+
+static void host_count(int64_t size) {
+  host_in_use += size;
+  if (host_in_use > host_peak_in_use) {
+    host_peak_in_use = host_in_use;
+  }
+}
+
+static void memory_run_start(struct memory_run *r) {
+  r->device_peak = device_pool_peak_in_use;
+  r->host_peak = host_peak_in_use;
+  r->allocs = memblock_allocs;
+  r->frees = memblock_frees;
+  device_pool_peak_in_use = device_pool_in_use;
+  host_peak_in_use = host_in_use;
+}
+
+static void memory_run_end(struct memory_run *r, int run) {
+  struct rusage usage;
+
+  if ((memory_report || cl_debug) && getrusage(RUSAGE_SELF, &usage) == 0) {
+    fprintf(stderr, "Run %d memory: %ld device bytes and %ld host bytes in use at peak, "
+            "%ld blocks allocated, %ld released, %ld KiB peak resident set.\n",
+            run, (long)device_pool_peak_in_use, (long)host_peak_in_use,
+            (long)(memblock_allocs - r->allocs), (long)(memblock_frees - r->frees),
+            (long)usage.ru_maxrss);
+  }
+  if (r->device_peak > device_pool_peak_in_use) {
+    device_pool_peak_in_use = r->device_peak;
+  }
+  if (r->host_peak > host_peak_in_use) {
+    host_peak_in_use = r->host_peak;
+  }
+}
+
+static const char fut_opencl_prelude[] =
+                  "typedef FUT_INDEX_T index_t;\ntypedef char int8_t;\ntypedef short int16_t;\ntypedef int int32_t;\ntypedef long int64_t;\ntypedef uchar uint8_t;\ntypedef ushort uint16_t;\ntypedef uint uint32_t;\ntypedef ulong uint64_t;\nstatic inline int8_t add8(int8_t x, int8_t y)\n{\n    return x + y;\n}\nstatic inline int16_t add16(int16_t x, int16_t y)\n{\n    return x + y;\n}\nstatic inline int32_t add32(int32_t x, int32_t y)\n{\n    return x + y;\n}\nstatic inline int64_t add64(int64_t x, int64_t y)\n{\n    return x + y;\n}\nstatic inline int8_t sub8(int8_t x, int8_t y)\n{\n    return x - y;\n}\nstatic inline int16_t sub16(int16_t x, int16_t y)\n{\n    return x - y;\n}\nstatic inline int32_t sub32(int32_t x, int32_t y)\n{\n    return x - y;\n}\nstatic inline int64_t sub64(int64_t x, int64_t y)\n{\n    return x - y;\n}\nstatic inline int8_t mul8(int8_t x, int8_t y)\n{\n    return x * y;\n}\nstatic inline int16_t mul16(int16_t x, int16_t y)\n{\n    return x * y;\n}\nstatic inline int32_t mul32(int32_t x, int32_t y)\n{\n    return x * y;\n}\nstatic inline int64_t mul64(int64_t x, int64_t y)\n{\n    return x * y;\n}\nstatic inline uint8_t udiv8(uint8_t x, uint8_t y)\n{\n    return x / y;\n}\nstatic inline uint16_t udiv16(uint16_t x, uint16_t y)\n{\n    return x / y;\n}\nstatic inline uint32_t udiv32(uint32_t x, uint32_t y)\n{\n    return x / y;\n}\nstatic inline uint64_t udiv64(uint64_t x, uint64_t y)\n{\n    return x / y;\n}\nstatic inline uint8_t umod8(uint8_t x, uint8_t y)\n{\n    return x % y;\n}\nstatic inline uint16_t umod16(uint16_t x, uint16_t y)\n{\n    return x % y;\n}\nstatic inline uint32_t umod32(uint32_t x, uint32_t y)\n{\n    return x % y;\n}\nstatic inline uint64_t umod64(uint64_t x, uint64_t y)\n{\n    return x % y;\n}\nstatic inline int8_t sdiv8(int8_t x, int8_t y)\n{\n    int8_t q = x / y;\n    int8_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int16_t sdiv16(int16_t x, int16_t y)\n{\n    int16_t q = x / y;\n    int16_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int32_t sdiv32(int32_t x, int32_t y)\n{\n    int32_t q = x / y;\n    int32_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int64_t sdiv64(int64_t x, int64_t y)\n{\n    int64_t q = x / y;\n    int64_t r = x % y;\n    \n    return q - ((r != 0 && r < 0 != y < 0) ? 1 : 0);\n}\nstatic inline int8_t smod8(int8_t x, int8_t y)\n{\n    int8_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int16_t smod16(int16_t x, int16_t y)\n{\n    int16_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int32_t smod32(int32_t x, int32_t y)\n{\n    int32_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int64_t smod64(int64_t x, int64_t y)\n{\n    int64_t r = x % y;\n    \n    return r + (r == 0 || (x > 0 && y > 0) || (x < 0 && y < 0) ? 0 : y);\n}\nstatic inline int8_t squot8(int8_t x, int8_t y)\n{\n    return x / y;\n}\nstatic inline int16_t squot16(int16_t x, int16_t y)\n{\n    return x / y;\n}\nstatic inline int32_t squot32(int32_t x, int32_t y)\n{\n    return x / y;\n}\nstatic inline int64_t squot64(int64_t x, int64_t y)\n{\n    return x / y;\n}\nstatic inline int8_t srem8(int8_t x, int8_t y)\n{\n    return x % y;\n}\nstatic inline int16_t srem16(int16_t x, int16_t y)\n{\n    return x % y;\n}\nstatic inline int32_t srem32(int32_t x, int32_t y)\n{\n    return x % y;\n}\nstatic inline int64_t srem64(int64_t x, int64_t y)\n{\n    return x % y;\n}\nstatic inline uint8_t shl8(uint8_t x, uint8_t y)\n{\n    return x << y;\n}\nstatic inline uint16_t shl16(uint16_t x, uint16_t y)\n{\n    return x << y;\n}\nstatic inline uint32_t shl32(uint32_t x, uint32_t y)\n{\n    return x << y;\n}\nstatic inline uint64_t shl64(uint64_t x, uint64_t y)\n{\n    return x << y;\n}\nstatic inline uint8_t lshr8(uint8_t x, uint8_t y)\n{\n    return x >> y;\n}\nstatic inline uint16_t lshr16(uint16_t x, uint16_t y)\n{\n    return x >> y;\n}\nstatic inline uint32_t lshr32(uint32_t x, uint32_t y)\n{\n    return x >> y;\n}\nstatic inline uint64_t lshr64(uint64_t x, uint64_t y)\n{\n    return x >> y;\n}\nstatic inline int8_t ashr8(int8_t x, int8_t y)\n{\n    return x >> y;\n}\nstatic inline int16_t ashr16(int16_t x, int16_t y)\n{\n    return x >> y;\n}\nstatic inline int32_t ashr32(int32_t x, int32_t y)\n{\n    return x >> y;\n}\nstatic inline int64_t ashr64(int64_t x, int64_t y)\n{\n    return x >> y;\n}\nstatic inline uint8_t and8(uint8_t x, uint8_t y)\n{\n    return x & y;\n}\nstatic inline uint16_t and16(uint16_t x, uint16_t y)\n{\n    return x & y;\n}\nstatic inline uint32_t and32(uint32_t x, uint32_t y)\n{\n    return x & y;\n}\nstatic inline uint64_t and64(uint64_t x, uint64_t y)\n{\n    return x & y;\n}\nstatic inline uint8_t or8(uint8_t x, uint8_t y)\n{\n    return x | y;\n}\nstatic inline uint16_t or16(uint16_t x, uint16_t y)\n{\n    return x | y;\n}\nstatic inline uint32_t or32(uint32_t x, uint32_t y)\n{\n    return x | y;\n}\nstatic inline uint64_t or64(uint64_t x, uint64_t y)\n{\n    return x | y;\n}\nstatic inline uint8_t xor8(uint8_t x, uint8_t y)\n{\n    return x ^ y;\n}\nstatic inline uint16_t xor16(uint16_t x, uint16_t y)\n{\n    return x ^ y;\n}\nstatic inline uint32_t xor32(uint32_t x, uint32_t y)\n{\n    return x ^ y;\n}\nstatic inline uint64_t xor64(uint64_t x, uint64_t y)\n{\n    return x ^ y;\n}\nstatic inline char ult8(uint8_t x, uint8_t y)\n{\n    return x < y;\n}\nstatic inline char ult16(uint16_t x, uint16_t y)\n{\n    return x < y;\n}\nstatic inline char ult32(uint32_t x, uint32_t y)\n{\n    return x < y;\n}\nstatic inline char ult64(uint64_t x, uint64_t y)\n{\n    return x < y;\n}\nstatic inline char ule8(uint8_t x, uint8_t y)\n{\n    return x <= y;\n}\nstatic inline char ule16(uint16_t x, uint16_t y)\n{\n    return x <= y;\n}\nstatic inline char ule32(uint32_t x, uint32_t y)\n{\n    return x <= y;\n}\nstatic inline char ule64(uint64_t x, uint64_t y)\n{\n    return x <= y;\n}\nstatic inline char slt8(int8_t x, int8_t y)\n{\n    return x < y;\n}\nstatic inline char slt16(int16_t x, int16_t y)\n{\n    return x < y;\n}\nstatic inline char slt32(int32_t x, int32_t y)\n{\n    return x < y;\n}\nstatic inline char slt64(int64_t x, int64_t y)\n{\n    return x < y;\n}\nstatic inline char sle8(int8_t x, int8_t y)\n{\n    return x <= y;\n}\nstatic inline char sle16(int16_t x, int16_t y)\n{\n    return x <= y;\n}\nstatic inline char sle32(int32_t x, int32_t y)\n{\n    return x <= y;\n}\nstatic inline char sle64(int64_t x, int64_t y)\n{\n    return x <= y;\n}\nstatic inline int8_t pow8(int8_t x, int8_t y)\n{\n    int8_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int16_t pow16(int16_t x, int16_t y)\n{\n    int16_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int32_t pow32(int32_t x, int32_t y)\n{\n    int32_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int64_t pow64(int64_t x, int64_t y)\n{\n    int64_t res = 1, rem = y;\n    \n    while (rem != 0) {\n        if (rem & 1)\n            res *= x;\n        rem >>= 1;\n        x *= x;\n    }\n    return res;\n}\nstatic inline int8_t sext_i8_i8(int8_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i8_i16(int8_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i8_i32(int8_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i8_i64(int8_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i16_i8(int16_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i16_i16(int16_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i16_i32(int16_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i16_i64(int16_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i32_i8(int32_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i32_i16(int32_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i32_i32(int32_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i32_i64(int32_t x)\n{\n    return x;\n}\nstatic inline int8_t sext_i64_i8(int64_t x)\n{\n    return x;\n}\nstatic inline int16_t sext_i64_i16(int64_t x)\n{\n    return x;\n}\nstatic inline int32_t sext_i64_i32(int64_t x)\n{\n    return x;\n}\nstatic inline int64_t sext_i64_i64(int64_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i8_i8(uint8_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i8_i16(uint8_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i8_i32(uint8_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i8_i64(uint8_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i16_i8(uint16_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i16_i16(uint16_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i16_i32(uint16_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i16_i64(uint16_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i32_i8(uint32_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i32_i16(uint32_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i32_i32(uint32_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i32_i64(uint32_t x)\n{\n    return x;\n}\nstatic inline uint8_t zext_i64_i8(uint64_t x)\n{\n    return x;\n}\nstatic inline uint16_t zext_i64_i16(uint64_t x)\n{\n    return x;\n}\nstatic inline uint32_t zext_i64_i32(uint64_t x)\n{\n    return x;\n}\nstatic inline uint64_t zext_i64_i64(uint64_t x)\n{\n    return x;\n}\nstatic inline float fdiv32(float x, float y)\n{\n    return x / y;\n}\nstatic inline float fadd32(float x, float y)\n{\n    return x + y;\n}\nstatic inline float fsub32(float x, float y)\n{\n    return x - y;\n}\nstatic inline float fmul32(float x, float y)\n{\n    return x * y;\n}\nstatic inline float fpow32(float x, float y)\n{\n    return pow(x, y);\n}\nstatic inline char cmplt32(float x, float y)\n{\n    return x < y;\n}\nstatic inline char cmple32(float x, float y)\n{\n    return x <= y;\n}\nstatic inline float sitofp_i8_f32(int8_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i16_f32(int16_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i32_f32(int32_t x)\n{\n    return x;\n}\nstatic inline float sitofp_i64_f32(int64_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i8_f32(uint8_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i16_f32(uint16_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i32_f32(uint32_t x)\n{\n    return x;\n}\nstatic inline float uitofp_i64_f32(uint64_t x)\n{\n    return x;\n}\nstatic inline int8_t fptosi_f32_i8(float x)\n{\n    return x;\n}\nstatic inline int16_t fptosi_f32_i16(float x)\n{\n    return x;\n}\nstatic inline int32_t fptosi_f32_i32(float x)\n{\n    return x;\n}\nstatic inline int64_t fptosi_f32_i64(float x)\n{\n    return x;\n}\nstatic inline uint8_t fptoui_f32_i8(float x)\n{\n    return x;\n}\nstatic inline uint16_t fptoui_f32_i16(float x)\n{\n    return x;\n}\nstatic inline uint32_t fptoui_f32_i32(float x)\n{\n    return x;\n}\nstatic inline uint64_t fptoui_f32_i64(float x)\n{\n    return x;\n}\n";
+static const char fut_opencl_program[] = FUT_KERNEL(
 __kernel void scan_kernel_62(__local volatile
                              int32_t *restrict binop_param_x_mem_local_aligned_0,
-                             int32_t per_thread_elements_61,
-                             int32_t group_size_57, int32_t size_37, __global
-                             unsigned char *mem_145, int32_t num_threads_58,
+                             index_t per_thread_elements_61,
+                             int32_t group_size_57, index_t size_37, __global
+                             unsigned char *a_mem_136, int32_t num_threads_58,
                              __global unsigned char *mem_147, __global
-                             unsigned char *mem_150)
+                             unsigned char *mem_150, __local
+                             int32_t *restrict elems_mem_local_aligned_1,
+                             int32_t tile_depth_189)
 {
     __local volatile char *restrict binop_param_x_mem_local_182 =
                           binop_param_x_mem_local_aligned_0;
     int32_t local_id_172;
     int32_t group_id_173;
     int32_t wave_size_174;
-    int32_t thread_chunk_size_176;
+    index_t thread_chunk_size_176;
     int32_t skip_waves_175;
     int32_t my_index_62;
     int32_t other_index_63;
@@ -491,7 +983,7 @@ __kernel void scan_kernel_62(__local volatile
     int32_t other_index_178;
     int32_t binop_param_x_179;
     int32_t binop_param_y_180;
-    int32_t my_index_64;
+    index_t my_index_64;
     int32_t other_index_65;
     int32_t binop_param_x_66;
     int32_t binop_param_y_67;
@@ -502,14 +994,13 @@ __kernel void scan_kernel_62(__local volatile
     wave_size_174 = LOCKSTEP_WIDTH;
     my_index_64 = skip_waves_175 * per_thread_elements_61;
     
-    int32_t starting_point_185 = skip_waves_175 * per_thread_elements_61;
-    int32_t remaining_elements_186 = size_37 - starting_point_185;
+    index_t starting_point_185 = skip_waves_175 * per_thread_elements_61;
+    index_t remaining_elements_186 = size_37 - starting_point_185;
     
-    if (sle32(remaining_elements_186, 0) || sle32(size_37,
-                                                  starting_point_185)) {
+    if (remaining_elements_186 <= 0 || size_37 <= starting_point_185) {
         thread_chunk_size_176 = 0;
     } else {
-        if (slt32(size_37, (skip_waves_175 + 1) * per_thread_elements_61)) {
+        if (size_37 < (skip_waves_175 + 1) * per_thread_elements_61) {
             thread_chunk_size_176 = size_37 - skip_waves_175 *
                 per_thread_elements_61;
         } else {
@@ -517,22 +1008,70 @@ __kernel void scan_kernel_62(__local volatile
         }
     }
     binop_param_x_66 = 0;
-    // sequentially scan a chunk
+    // sequentially scan a chunk, moving it through local memory
+    // tile_depth_189 elements per thread at a time, so that the work-group
+    // reads and writes consecutive elements together
     {
-        for (int elements_scanned_184 = 0; elements_scanned_184 <
-             thread_chunk_size_176; elements_scanned_184++) {
-            binop_param_y_67 = *(__global
-                                 int32_t *) &mem_145[(elements_scanned_184 *
-                                                      num_threads_58 +
-                                                      skip_waves_175) * 4];
-            
-            int32_t res_68 = binop_param_x_66 + binop_param_y_67;
-            
-            binop_param_x_66 = res_68;
-            *(__global int32_t *) &mem_147[(elements_scanned_184 *
-                                            num_threads_58 + skip_waves_175) *
-                                           4] = binop_param_x_66;
-            my_index_64 += 1;
+        __local int32_t *restrict elems_mem_local_190 =
+                        elems_mem_local_aligned_1;
+        index_t group_start_191 = (index_t) group_id_173 * group_size_57 *
+                per_thread_elements_61;
+        
+        for (index_t tile_start_192 = 0; tile_start_192 <
+             per_thread_elements_61; tile_start_192 += tile_depth_189) {
+            // load the tile
+            for (int32_t i_193 = 0; i_193 < tile_depth_189; i_193++) {
+                int32_t j_194 = i_193 * group_size_57 + local_id_172;
+                int32_t thread_195 = squot32(j_194, tile_depth_189);
+                int32_t offset_196 = j_194 - thread_195 * tile_depth_189;
+                index_t element_197 = tile_start_192 + offset_196;
+                index_t index_198 = group_start_191 + thread_195 *
+                        per_thread_elements_61 + element_197;
+                
+                if (element_197 < per_thread_elements_61 && index_198 <
+                    size_37) {
+                    int32_t binop_param_noncurried_54 = *(__global
+                                                          int32_t *) &a_mem_136[index_198 *
+                                                                                4];
+                    
+                    // the map over the input, fused into the load
+                    elems_mem_local_190[thread_195 * (tile_depth_189 + 1) +
+                                        offset_196] =
+                        binop_param_noncurried_54 + 10;
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            for (int32_t offset_199 = 0; offset_199 < tile_depth_189 &&
+                 tile_start_192 + offset_199 < thread_chunk_size_176;
+                 offset_199++) {
+                binop_param_y_67 = elems_mem_local_190[local_id_172 *
+                                                       (tile_depth_189 + 1) +
+                                                       offset_199];
+                
+                int32_t res_68 = binop_param_x_66 + binop_param_y_67;
+                
+                binop_param_x_66 = res_68;
+                elems_mem_local_190[local_id_172 * (tile_depth_189 + 1) +
+                                    offset_199] = binop_param_x_66;
+                my_index_64 += 1;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            // store the tile
+            for (int32_t i_200 = 0; i_200 < tile_depth_189; i_200++) {
+                int32_t j_201 = i_200 * group_size_57 + local_id_172;
+                int32_t thread_202 = squot32(j_201, tile_depth_189);
+                int32_t offset_203 = j_201 - thread_202 * tile_depth_189;
+                index_t element_204 = tile_start_192 + offset_203;
+                index_t index_205 = group_start_191 + thread_202 *
+                        per_thread_elements_61 + element_204;
+                
+                if (element_204 < per_thread_elements_61 && index_205 <
+                    size_37)
+                    *(__global int32_t *) &mem_147[index_205 * 4] =
+                        elems_mem_local_190[thread_202 * (tile_depth_189 + 1) +
+                                            offset_203];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
         }
     }
     *(__local volatile int32_t *) &binop_param_x_mem_local_182[local_id_172 *
@@ -904,18 +1443,18 @@ __kernel void map_kernel_96(__global unsigned char *mem_160,
                                         elem_id_98) * 4] = res_95;
     }
 }
-__kernel void map_kernel_104(__global unsigned char *mem_153,
-                             int32_t per_thread_elements_61,
-                             int32_t group_size_57, int32_t size_37, __global
+__kernel void map_kernel_104(__global unsigned char *mem_147,
+                             index_t per_thread_elements_61,
+                             int32_t group_size_57, index_t size_37, __global
                              unsigned char *mem_163, __global
                              unsigned char *mem_165)
 {
-    const uint result_map_index_104 = get_global_id(0);
+    const index_t result_map_index_104 = get_global_id(0);
     
     if (result_map_index_104 >= size_37)
         return;
     
-    int32_t j_105;
+    index_t j_105;
     int32_t binop_param_y_102;
     
     // compute thread index
@@ -924,17 +1463,17 @@ __kernel void map_kernel_104(__global unsigned char *mem_153,
     }
     // read kernel parameters
     {
-        binop_param_y_102 = *(__global int32_t *) &mem_153[(squot32(j_105,
-                                                                    per_thread_elements_61) *
+        binop_param_y_102 = *(__global int32_t *) &mem_147[(j_105 /
+                                                            per_thread_elements_61 *
                                                             per_thread_elements_61 +
                                                             (j_105 -
-                                                             squot32(j_105,
-                                                                     per_thread_elements_61) *
+                                                             j_105 /
+                                                             per_thread_elements_61 *
                                                              per_thread_elements_61)) *
                                                            4];
     }
     
-    int32_t thread_id_106 = squot32(j_105, per_thread_elements_61);
+    int32_t thread_id_106 = j_105 / per_thread_elements_61;
     char cond_107 = 0 == thread_id_106;
     int32_t carry_in_index_108 = thread_id_106 - 1;
     int32_t new_index_110 = squot32(carry_in_index_108, group_size_57);
@@ -958,13 +1497,195 @@ __kernel void map_kernel_104(__global unsigned char *mem_153,
         *(__global int32_t *) &mem_165[j_105 * 4] = final_result_109;
     }
 }
+__kernel void lookback_scan_kernel(__local int32_t *restrict rows_mem_local,
+                                   __local volatile int32_t *restrict sums_mem_local,
+                                   int32_t tile_depth, index_t size_37,
+                                   __global unsigned char *a_mem_136,
+                                   __global unsigned char *mem_165,
+                                   __global volatile int32_t *status_mem,
+                                   __global volatile int32_t *values_mem)
+{
+    int32_t local_id = get_local_id(0);
+    int32_t group_size = get_local_size(0);
+    int32_t row = local_id * (tile_depth + 1);
+    
+    // take tiles in the order in which work-groups start, rather than by
+    // group id, so that every tile looked back at belongs to a work-group
+    // that is already running or done, however the device schedules them
+    if (local_id == 0)
+        sums_mem_local[group_size] = atomic_inc(&status_mem[0]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int32_t tile_id = sums_mem_local[group_size];
+    index_t tile_start = (index_t) tile_id * group_size * tile_depth;
+    
+    // load the tile, with the map over the input fused into the load
+    for (int32_t i = 0; i < tile_depth; i++) {
+        int32_t j = i * group_size + local_id;
+        int32_t thread = squot32(j, tile_depth);
+        int32_t offset = j - thread * tile_depth;
+        index_t index = tile_start + j;
+        int32_t x = 0;
+        
+        if (index < size_37)
+            x = *(__global int32_t *) &a_mem_136[index * 4] + 10;
+        rows_mem_local[thread * (tile_depth + 1) + offset] = x;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    // scan the work-item's own row
+    int32_t sum = 0;
+    
+    for (int32_t offset = 0; offset < tile_depth; offset++) {
+        sum += rows_mem_local[row + offset];
+        rows_mem_local[row + offset] = sum;
+    }
+    sums_mem_local[local_id] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    // scan the row sums, with a barrier after every step rather than
+    // relying on the lockstep width
+    for (int32_t skip = 1; skip < group_size; skip *= 2) {
+        int32_t x = local_id >= skip ? sums_mem_local[local_id - skip] : 0;
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        sums_mem_local[local_id] += x;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    // publish the tile's aggregate, look back at the tiles before it for
+    // the sum of everything preceding it, and publish the tile's inclusive
+    // prefix; the status of tile i is 0 while nothing is known, 1 once
+    // values_mem[2*i] holds its aggregate, and 2 once values_mem[2*i+1]
+    // holds its inclusive prefix
+    if (local_id == 0) {
+        int32_t aggregate = sums_mem_local[group_size - 1];
+        int32_t prefix = 0;
+        
+        if (tile_id > 0) {
+            atomic_xchg(&values_mem[2 * tile_id], aggregate);
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+            atomic_xchg(&status_mem[1 + tile_id], 1);
+            
+            int32_t pred = tile_id - 1;
+            
+            while (pred >= 0) {
+                int32_t status = atomic_add(&status_mem[1 + pred], 0);
+                
+                if (status == 0)
+                    continue;
+                mem_fence(CLK_GLOBAL_MEM_FENCE);
+                if (status == 2) {
+                    prefix += atomic_add(&values_mem[2 * pred + 1], 0);
+                    break;
+                }
+                prefix += atomic_add(&values_mem[2 * pred], 0);
+                pred--;
+            }
+        }
+        atomic_xchg(&values_mem[2 * tile_id + 1], prefix + aggregate);
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        atomic_xchg(&status_mem[1 + tile_id], 2);
+        sums_mem_local[group_size + 1] = prefix;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    // add the carry into the row, and store the tile
+    int32_t carry = sums_mem_local[group_size + 1] + (local_id > 0 ?
+                                                      sums_mem_local[local_id -
+                                                                     1] : 0);
+    
+    for (int32_t offset = 0; offset < tile_depth; offset++)
+        rows_mem_local[row + offset] += carry;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int32_t i = 0; i < tile_depth; i++) {
+        int32_t j = i * group_size + local_id;
+        int32_t thread = squot32(j, tile_depth);
+        int32_t offset = j - thread * tile_depth;
+        index_t index = tile_start + j;
+        
+        if (index < size_37)
+            *(__global int32_t *) &mem_165[index * 4] =
+                rows_mem_local[thread * (tile_depth + 1) + offset];
+    }
+}
+__kernel void cpu_scan_kernel(index_t block_elems, index_t size_37,
+                              __global unsigned char *a_mem_136,
+                              __global unsigned char *mem_165,
+                              __global volatile int32_t *status_mem,
+                              __global volatile int32_t *values_mem)
+{
+    // take blocks in the order in which work-items start, as in
+    // lookback_scan_kernel
+    int32_t block_id = atomic_inc(&status_mem[0]);
+    index_t block_start = (index_t) block_id * block_elems;
+    index_t block_size = size_37 - block_start < block_elems ? size_37 -
+            block_start : block_elems;
+    index_t vec_elems = block_size / 4;
+    __global const int32_t *in = (__global const int32_t *) a_mem_136 +
+                           block_start;
+    __global int32_t *out = (__global int32_t *) mem_165 + block_start;
+    
+    // sum the block, with the map over the input fused into the load; the
+    // block stays in cache for the second pass
+    int32_t aggregate = 0;
+    
+    for (index_t i = 0; i < vec_elems; i++) {
+        int4 x = vload4(i, in);
+        
+        aggregate += x.s0 + x.s1 + x.s2 + x.s3;
+    }
+    for (index_t i = 4 * vec_elems; i < block_size; i++)
+        aggregate += in[i];
+    aggregate += 10 * (int32_t) block_size;
+    
+    // look back for the sum of the blocks before this one, as in
+    // lookback_scan_kernel
+    int32_t prefix = 0;
+    
+    if (block_id > 0) {
+        atomic_xchg(&values_mem[2 * block_id], aggregate);
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        atomic_xchg(&status_mem[1 + block_id], 1);
+        
+        int32_t pred = block_id - 1;
+        
+        while (pred >= 0) {
+            int32_t status = atomic_add(&status_mem[1 + pred], 0);
+            
+            if (status == 0)
+                continue;
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+            if (status == 2) {
+                prefix += atomic_add(&values_mem[2 * pred + 1], 0);
+                break;
+            }
+            prefix += atomic_add(&values_mem[2 * pred], 0);
+            pred--;
+        }
+    }
+    atomic_xchg(&values_mem[2 * block_id + 1], prefix + aggregate);
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    atomic_xchg(&status_mem[1 + block_id], 2);
+    
+    // scan the block four elements at a time, carrying the running sum
+    // in a register
+    int32_t carry = prefix;
+    
+    for (index_t i = 0; i < vec_elems; i++) {
+        int4 x = vload4(i, in) + 10;
+        
+        x.s0 += carry;
+        x.s1 += x.s0;
+        x.s2 += x.s1;
+        x.s3 += x.s2;
+        vstore4(x, i, out);
+        carry = x.s3;
+    }
+    for (index_t i = 4 * vec_elems; i < block_size; i++) {
+        carry += in[i] + 10;
+        out[i] = carry;
+    }
+}
 );
-static cl_kernel map_kernel_52;
-static int map_kernel_52total_runtime = 0;
-static int map_kernel_52runs = 0;
-static cl_kernel fut_kernel_map_transpose_i32;
-static int fut_kernel_map_transpose_i32total_runtime = 0;
-static int fut_kernel_map_transpose_i32runs = 0;
 static cl_kernel scan_kernel_62;
 static int scan_kernel_62total_runtime = 0;
 static int scan_kernel_62runs = 0;
@@ -980,27 +1701,16 @@ static int map_kernel_96runs = 0;
 static cl_kernel map_kernel_104;
 static int map_kernel_104total_runtime = 0;
 static int map_kernel_104runs = 0;
-void setup_opencl_and_load_kernels()
-
+static cl_kernel lookback_scan_kernel;
+static int lookback_scan_kerneltotal_runtime = 0;
+static int lookback_scan_kernelruns = 0;
+static cl_kernel cpu_scan_kernel;
+static int cpu_scan_kerneltotal_runtime = 0;
+static int cpu_scan_kernelruns = 0;
+static void load_kernels(cl_program prog)
 {
     cl_int error;
-    cl_program prog = setup_opencl(fut_opencl_prelude, fut_opencl_program);
     
-    {
-        map_kernel_52 = clCreateKernel(prog, "map_kernel_52", &error);
-        assert(error == 0);
-        if (cl_debug)
-            fprintf(stderr, "Created kernel %s.\n", "map_kernel_52");
-    }
-    {
-        fut_kernel_map_transpose_i32 = clCreateKernel(prog,
-                                                      "fut_kernel_map_transpose_i32",
-                                                      &error);
-        assert(error == 0);
-        if (cl_debug)
-            fprintf(stderr, "Created kernel %s.\n",
-                    "fut_kernel_map_transpose_i32");
-    }
     {
         scan_kernel_62 = clCreateKernel(prog, "scan_kernel_62", &error);
         assert(error == 0);
@@ -1031,12 +1741,50 @@ void setup_opencl_and_load_kernels()
         if (cl_debug)
             fprintf(stderr, "Created kernel %s.\n", "map_kernel_104");
     }
-}
-void post_opencl_setup(struct opencl_device_option *option)
-{
-    if (strcmp(option->platform_name, "NVIDIA CUDA") == 0 &&
-        option->device_type == CL_DEVICE_TYPE_GPU) {
-        cl_lockstep_width = 32;
+    {
+        lookback_scan_kernel = clCreateKernel(prog, "lookback_scan_kernel",
+                                              &error);
+        assert(error == 0);
+        if (cl_debug)
+            fprintf(stderr, "Created kernel %s.\n", "lookback_scan_kernel");
+    }
+    {
+        cpu_scan_kernel = clCreateKernel(prog, "cpu_scan_kernel", &error);
+        assert(error == 0);
+        if (cl_debug)
+            fprintf(stderr, "Created kernel %s.\n", "cpu_scan_kernel");
+    }
+}
+void setup_opencl_and_load_kernels()
+{
+    cl_program prog = setup_opencl(fut_opencl_prelude, fut_opencl_program);
+    
+    load_kernels(prog);
+}
+/* Rebuilds the kernels to index with 64-bit integers, for arrays whose
+   byte offsets do not fit in 32 bits. */
+static void use_index64_kernels()
+{
+    if (cl_index64)
+        return;
+    cl_index64 = 1;
+    if (cl_debug)
+        fprintf(stderr, "Rebuilding kernels with 64-bit indexing.\n");
+    OPENCL_SUCCEED(clReleaseKernel(scan_kernel_62));
+    OPENCL_SUCCEED(clReleaseKernel(map_kernel_71));
+    OPENCL_SUCCEED(clReleaseKernel(scan_kernel_80));
+    OPENCL_SUCCEED(clReleaseKernel(map_kernel_96));
+    OPENCL_SUCCEED(clReleaseKernel(map_kernel_104));
+    OPENCL_SUCCEED(clReleaseKernel(lookback_scan_kernel));
+    OPENCL_SUCCEED(clReleaseKernel(cpu_scan_kernel));
+    load_kernels(load_opencl_program(fut_opencl_prelude, fut_opencl_program));
+}
+void post_opencl_setup(struct opencl_device_option *option)
+{
+    setup_zero_copy(option);
+    if (strcmp(option->platform_name, "NVIDIA CUDA") == 0 &&
+        option->device_type == CL_DEVICE_TYPE_GPU) {
+        cl_lockstep_width = 32;
         if (cl_debug)
             fprintf(stderr, "Setting lockstep width to: %d\n",
                     cl_lockstep_width);
@@ -1048,34 +1796,31 @@ void post_opencl_setup(struct opencl_device_option *option)
             fprintf(stderr, "Setting lockstep width to: %d\n",
                     cl_lockstep_width);
     }
+    setup_single_pass_scan(option);
 }
 struct memblock_device {
     int *references;
     cl_mem mem;
+    int64_t size;
 } ;
 static void memblock_unref_device(struct memblock_device *block)
 {
     if (block->references != NULL) {
         *block->references -= 1;
         if (*block->references == 0) {
-            OPENCL_SUCCEED(clReleaseMemObject(block->mem));
-            free(block->references);
+            device_pool_free(block->mem, block->size);
+            refcount_release(block->references);
             block->references = NULL;
+            memblock_frees++;
         }
     }
 }
-static void memblock_alloc_device(struct memblock_device *block, int32_t size)
+static void memblock_alloc_device(struct memblock_device *block, int64_t size)
 {
     memblock_unref_device(block);
-    
-    cl_int clCreateBuffer_succeeded_263;
-    
-    block->mem = clCreateBuffer(fut_cl_context, CL_MEM_READ_WRITE, size >
-                                0 ? size : 1, NULL,
-                                &clCreateBuffer_succeeded_263);
-    OPENCL_SUCCEED(clCreateBuffer_succeeded_263);
-    block->references = (int *) malloc(sizeof(int));
-    *block->references = 1;
+    block->mem = device_pool_alloc(size, &block->size);
+    block->references = refcount_new();
+    memblock_allocs++;
 }
 static void memblock_set_device(struct memblock_device *lhs,
                                 struct memblock_device *rhs)
@@ -1093,16 +1838,17 @@ static void memblock_unref_local(struct memblock_local *block)
     if (block->references != NULL) {
         *block->references -= 1;
         if (*block->references == 0) {
-            free(block->references);
+            refcount_release(block->references);
             block->references = NULL;
+            memblock_frees++;
         }
     }
 }
-static void memblock_alloc_local(struct memblock_local *block, int32_t size)
+static void memblock_alloc_local(struct memblock_local *block, int64_t size)
 {
     memblock_unref_local(block);
-    block->references = (int *) malloc(sizeof(int));
-    *block->references = 1;
+    block->references = refcount_new();
+    memblock_allocs++;
 }
 static void memblock_set_local(struct memblock_local *lhs,
                                struct memblock_local *rhs)
@@ -1114,6 +1860,7 @@ static void memblock_set_local(struct memblock_local *lhs,
 struct memblock {
     int *references;
     char *mem;
+    int64_t size;
 } ;
 static void memblock_unref(struct memblock *block)
 {
@@ -1121,17 +1868,21 @@ static void memblock_unref(struct memblock *block)
         *block->references -= 1;
         if (*block->references == 0) {
             free(block->mem);
-            free(block->references);
+            refcount_release(block->references);
             block->references = NULL;
+            host_count(-block->size);
+            memblock_frees++;
         }
     }
 }
-static void memblock_alloc(struct memblock *block, int32_t size)
+static void memblock_alloc(struct memblock *block, int64_t size)
 {
     memblock_unref(block);
-    block->mem = (char *) malloc(size);
-    block->references = (int *) malloc(sizeof(int));
-    *block->references = 1;
+    block->mem = (char *) host_alloc(size);
+    block->references = refcount_new();
+    block->size = size;
+    host_count(size);
+    memblock_allocs++;
 }
 static void memblock_set(struct memblock *lhs, struct memblock *rhs)
 {
@@ -1139,13 +1890,13 @@ static void memblock_set(struct memblock *lhs, struct memblock *rhs)
     (*rhs->references)++;
     *lhs = *rhs;
 }
-struct tuple_int32_t_device_mem_int32_t {
-    int32_t elem_0;
+struct tuple_int64_t_device_mem_int64_t {
+    int64_t elem_0;
     struct memblock_device elem_1;
-    int32_t elem_2;
+    int64_t elem_2;
 } ;
-static struct tuple_int32_t_device_mem_int32_t
-futhark_main(int32_t a_mem_size_135, struct memblock_device a_mem_136, int32_t size_37);
+static struct tuple_int64_t_device_mem_int64_t
+futhark_main(int64_t a_mem_size_135, struct memblock_device a_mem_136, int64_t size_37);
 static inline float futhark_log32(float x)
 {
     return log(x);
@@ -1911,64 +2662,183 @@ static inline double fpconv_f64_f64(double x)
     return x;
 }
 static int detail_timing = 0;
+/* Single-pass scan.
+
+   The multi-pass scan reads and writes the array several times over
+   five kernel launches.  lookback_scan_kernel instead scans it in one
+   launch, reading every element once and writing it once: each
+   work-group scans a tile in local memory, publishes the tile's
+   aggregate, and looks back at the tiles before it (a decoupled
+   look-back) until it meets one whose inclusive prefix is known.  The
+   per-tile status words are cleared with a fill before the launch.
+
+   Tiles are handed out by an atomic counter in the order in which
+   work-groups start, so a work-group only ever waits for ones that
+   have started before it.  This keeps it correct on CPU
+   implementations, which may run work-groups in any order and not
+   all at once, and the in-group scan uses barriers rather than the
+   lockstep width.
+
+   The multi-pass scan's in-group scans are only correct for groups of
+   at most LOCKSTEP_WIDTH waves, so the single-pass scan is used when
+   the group size or the number of groups exceeds the square of the
+   lockstep width, which on CPU devices is always.  --single-pass-scan
+   forces the single-pass scan.  --multi-pass-scan forces the
+   multi-pass scan, but only where it is correct; elsewhere it is
+   refused with a warning.
+
+   On CPU devices, where work-items do not share loads the way GPU
+   threads do, the tiles moved through local memory only cost copies.
+   cpu_scan_kernel is used instead: every work-item is a work-group of
+   its own and takes a contiguous block that fits in half the device's
+   cache, sums it with int4 loads, looks back like lookback_scan_kernel,
+   and then scans the block, now in cache, four elements at a time with
+   the running sum kept in a register.  Blocks are made smaller when
+   there would be fewer than CPU_SCAN_BLOCKS_PER_UNIT of them per
+   compute unit. */
+
+#define CPU_SCAN_MIN_BLOCK (4 << 10)
+#define CPU_SCAN_MAX_BLOCK (256 << 10)
+#define CPU_SCAN_BLOCKS_PER_UNIT 4
+
+static int single_pass_scan = -1; // Negative means decided by the device.
+static int cpu_scan = 0;
+
+static void setup_single_pass_scan(struct opencl_device_option *option) {
+  size_t waves = cl_lockstep_width * cl_lockstep_width;
+  int multi_pass_ok = cl_group_size <= waves && cl_num_groups <= waves;
+
+  if (single_pass_scan == 0 && !multi_pass_ok) {
+    fprintf(stderr, "Warning: The multi-pass scan needs a group size and number of groups "
+            "of at most %zu on this device; using the single-pass scan\n", waves);
+  }
+  if (single_pass_scan <= 0) {
+    single_pass_scan = !multi_pass_ok;
+  }
+  cpu_scan = single_pass_scan && option->device_type == CL_DEVICE_TYPE_CPU;
+  if (cl_debug && single_pass_scan) {
+    fprintf(stderr, "Using the single-pass scan%s.\n",
+            cpu_scan ? " with the CPU kernel" : "");
+  }
+}
+
+/* Returns the number of elements in each block of cpu_scan_kernel for
+   an array of n elements, a multiple of four. */
+static int64_t cpu_scan_block_elems(int64_t n) {
+  cl_ulong cache_size;
+  cl_uint compute_units;
+  int64_t block;
+
+  OPENCL_SUCCEED(clGetDeviceInfo(fut_cl_device, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE,
+                                 sizeof(cache_size), &cache_size, NULL));
+  OPENCL_SUCCEED(clGetDeviceInfo(fut_cl_device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                                 sizeof(compute_units), &compute_units, NULL));
+  block = cache_size / 2;
+  if (block > CPU_SCAN_MAX_BLOCK) {
+    block = CPU_SCAN_MAX_BLOCK;
+  }
+  while (block > CPU_SCAN_MIN_BLOCK &&
+         n * (int64_t) sizeof(int32_t) / block <
+         (int64_t) compute_units * CPU_SCAN_BLOCKS_PER_UNIT) {
+    block /= 2;
+  }
+  if (block < CPU_SCAN_MIN_BLOCK) {
+    block = CPU_SCAN_MIN_BLOCK;
+  }
+  return block / (4 * sizeof(int32_t)) * 4;
+}
+
+static struct tuple_int64_t_device_mem_int64_t
+futhark_main_single_pass(struct memblock_device a_mem_136, int64_t size_37) {
+  struct tuple_int64_t_device_mem_int64_t ret;
+  struct memblock_device status_mem, values_mem, out_mem;
+  cl_kernel kernel = cpu_scan ? cpu_scan_kernel : lookback_scan_kernel;
+  int32_t group_size = cpu_scan ? 1 : cl_group_size;
+  int32_t tile_depth = cpu_scan ? 0 : scan_tile_depth(group_size);
+  int64_t tile_elems = cpu_scan ? cpu_scan_block_elems(size_37) :
+    (int64_t) group_size * tile_depth;
+  int64_t num_tiles = (size_37 + tile_elems - 1) / tile_elems;
+  cl_int zero = 0;
+  int *runs = cpu_scan ? &cpu_scan_kernelruns : &lookback_scan_kernelruns;
+  int *total_runtime = cpu_scan ? &cpu_scan_kerneltotal_runtime :
+    &lookback_scan_kerneltotal_runtime;
+
+  status_mem.references = NULL;
+  values_mem.references = NULL;
+  out_mem.references = NULL;
+  // The status words follow the tile counter.
+  memblock_alloc_device(&status_mem, (num_tiles + 1) * sizeof(int32_t));
+  memblock_alloc_device(&values_mem, 2 * num_tiles * sizeof(int32_t));
+  memblock_alloc_device(&out_mem, 4 * size_37);
+
+  if (num_tiles > 0) {
+    const size_t global_work_size[1] = {num_tiles * group_size};
+    const size_t local_work_size[1] = {group_size};
+    int64_t time_start = 0, time_end;
+
+    const char *name = cpu_scan ? "cpu_scan_kernel" : "lookback_scan_kernel";
+    cl_uint arg = 0;
+
+    OPENCL_SUCCEED(clEnqueueFillBuffer(fut_cl_queue, status_mem.mem, &zero, sizeof(zero),
+                                       0, (num_tiles + 1) * sizeof(int32_t), 0, NULL, NULL));
+    if (cpu_scan) {
+      OPENCL_SUCCEED(set_index_kernel_arg(kernel, arg++, tile_elems));
+    } else {
+      OPENCL_SUCCEED(clSetKernelArg(kernel, arg++,
+                                    (tile_depth + 1) * group_size * sizeof(int32_t), NULL));
+      // The row sums, then the tile number and the carry into the tile.
+      OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, (group_size + 2) * sizeof(int32_t), NULL));
+      OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, sizeof(tile_depth), &tile_depth));
+    }
+    OPENCL_SUCCEED(set_index_kernel_arg(kernel, arg++, size_37));
+    OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, sizeof(a_mem_136.mem), &a_mem_136.mem));
+    OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, sizeof(out_mem.mem), &out_mem.mem));
+    OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, sizeof(status_mem.mem), &status_mem.mem));
+    OPENCL_SUCCEED(clSetKernelArg(kernel, arg++, sizeof(values_mem.mem), &values_mem.mem));
+    if (cl_debug) {
+      fprintf(stderr, "Launching %s with global work size [%zu].\n",
+              name, global_work_size[0]);
+      time_start = get_wall_time();
+    }
+    OPENCL_SUCCEED(clEnqueueNDRangeKernel(fut_cl_queue, kernel, 1, NULL,
+                                          global_work_size, local_work_size, 0, NULL, NULL));
+    if (cl_debug) {
+      OPENCL_SUCCEED(clFinish(fut_cl_queue));
+      time_end = get_wall_time();
+      if (detail_timing) {
+        *total_runtime += time_end - time_start;
+        (*runs)++;
+        fprintf(stderr, "kernel %s runtime: %ldus\n", name,
+                (long) (time_end - time_start));
+      }
+    }
+  }
+
+  ret.elem_0 = 4 * size_37;
+  ret.elem_1.references = NULL;
+  memblock_set_device(&ret.elem_1, &out_mem);
+  ret.elem_2 = size_37;
+  memblock_unref_device(&status_mem);
+  memblock_unref_device(&values_mem);
+  memblock_unref_device(&out_mem);
+  return ret;
+}
+
 static
-struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
+struct tuple_int64_t_device_mem_int64_t futhark_main(int64_t a_mem_size_135,
                                                      struct memblock_device a_mem_136,
-                                                     int32_t size_37)
+                                                     int64_t size_37)
 {
-    int32_t out_memsize_167;
+    if (single_pass_scan)
+        return futhark_main_single_pass(a_mem_136, size_37);
+    
+    int64_t out_memsize_167;
     struct memblock_device out_mem_166;
     
     out_mem_166.references = NULL;
     
-    int32_t out_arrsize_168;
-    int32_t bytes_137 = 4 * size_37;
-    struct memblock_device mem_138;
-    
-    mem_138.references = NULL;
-    memblock_alloc_device(&mem_138, bytes_137);
-    
-    int32_t group_size_169;
-    int32_t num_groups_170;
-    
-    group_size_169 = cl_group_size;
-    num_groups_170 = squot32(size_37 + group_size_169 - 1, group_size_169);
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_52, 0, sizeof(a_mem_136.mem),
-                                  &a_mem_136.mem));
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_52, 1, sizeof(size_37), &size_37));
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_52, 2, sizeof(mem_138.mem),
-                                  &mem_138.mem));
-    if (1 * (num_groups_170 * group_size_169) != 0) {
-        const size_t global_work_size_213[1] = {num_groups_170 *
-                     group_size_169};
-        const size_t local_work_size_217[1] = {group_size_169};
-        int64_t time_start_214, time_end_215;
-        
-        if (cl_debug) {
-            fprintf(stderr, "Launching %s with global work size [",
-                    "map_kernel_52");
-            fprintf(stderr, "%zu", global_work_size_213[0]);
-            fprintf(stderr, "].\n");
-            time_start_214 = get_wall_time();
-        }
-        OPENCL_SUCCEED(clEnqueueNDRangeKernel(fut_cl_queue, map_kernel_52, 1,
-                                              NULL, global_work_size_213,
-                                              local_work_size_217, 0, NULL,
-                                              NULL));
-        if (cl_debug) {
-            OPENCL_SUCCEED(clFinish(fut_cl_queue));
-            time_end_215 = get_wall_time();
-            
-            long time_diff_216 = time_end_215 - time_start_214;
-            
-            if (detail_timing) {
-                map_kernel_52total_runtime += time_diff_216;
-                map_kernel_52runs++;
-                fprintf(stderr, "kernel %s runtime: %ldus\n", "map_kernel_52",
-                        (int) time_diff_216);
-            }
-        }
-    }
+    int64_t out_arrsize_168;
+    int64_t bytes_137 = 4 * size_37;
     
     int32_t num_groups_56;
     
@@ -1980,130 +2850,12 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
     
     int32_t num_threads_58 = num_groups_56 * group_size_57;
     int32_t y_59 = num_threads_58 - 1;
-    int32_t x_60 = size_37 + y_59;
-    int32_t per_thread_elements_61 = squot32(x_60, num_threads_58);
-    int32_t y_115 = smod32(size_37, num_threads_58);
-    int32_t x_116 = num_threads_58 - y_115;
-    int32_t y_117 = smod32(x_116, num_threads_58);
-    int32_t padded_size_118 = size_37 + y_117;
-    int32_t padding_119 = padded_size_118 - size_37;
-    int32_t x_121 = padded_size_118 + y_59;
-    int32_t offset_multiple_122 = squot32(x_121, num_threads_58);
-    int32_t bytes_139 = 4 * padding_119;
-    struct memblock_device mem_140;
-    
-    mem_140.references = NULL;
-    memblock_alloc_device(&mem_140, bytes_139);
-    
-    int32_t bytes_141 = 4 * padded_size_118;
-    struct memblock_device mem_142;
-    
-    mem_142.references = NULL;
-    memblock_alloc_device(&mem_142, bytes_141);
-    
-    int32_t tmp_offs_171 = 0;
-    
-    if (size_37 * sizeof(int32_t) > 0) {
-        OPENCL_SUCCEED(clEnqueueCopyBuffer(fut_cl_queue, mem_138.mem,
-                                           mem_142.mem, 0, tmp_offs_171 * 4,
-                                           size_37 * sizeof(int32_t), 0, NULL,
-                                           NULL));
-        if (cl_debug)
-            OPENCL_SUCCEED(clFinish(fut_cl_queue));
-    }
-    tmp_offs_171 += size_37;
-    if (padding_119 * sizeof(int32_t) > 0) {
-        OPENCL_SUCCEED(clEnqueueCopyBuffer(fut_cl_queue, mem_140.mem,
-                                           mem_142.mem, 0, tmp_offs_171 * 4,
-                                           padding_119 * sizeof(int32_t), 0,
-                                           NULL, NULL));
-        if (cl_debug)
-            OPENCL_SUCCEED(clFinish(fut_cl_queue));
-    }
-    tmp_offs_171 += padding_119;
-    
-    int32_t x_144 = 4 * per_thread_elements_61;
-    int32_t bytes_143 = x_144 * num_threads_58;
-    struct memblock_device mem_145;
-    
-    mem_145.references = NULL;
-    memblock_alloc_device(&mem_145, bytes_143);
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 0,
-                                  sizeof(mem_145.mem), &mem_145.mem));
-    
-    int32_t kernel_arg_218 = 0;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 1,
-                                  sizeof(kernel_arg_218), &kernel_arg_218));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 2,
-                                  sizeof(mem_142.mem), &mem_142.mem));
-    
-    int32_t kernel_arg_219 = 0;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 3,
-                                  sizeof(kernel_arg_219), &kernel_arg_219));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 4,
-                                  sizeof(per_thread_elements_61),
-                                  &per_thread_elements_61));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 5,
-                                  sizeof(num_threads_58), &num_threads_58));
-    
-    int32_t kernel_arg_220 = per_thread_elements_61 * num_threads_58;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 6,
-                                  sizeof(kernel_arg_220), &kernel_arg_220));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 7, (16 + 1) *
-                                  16 * sizeof(int32_t), NULL));
-    if (1 * (per_thread_elements_61 + srem32(16 - srem32(per_thread_elements_61,
-                                                         16), 16)) *
-        (num_threads_58 + srem32(16 - srem32(num_threads_58, 16), 16)) * 1 !=
-        0) {
-        const size_t global_work_size_221[3] = {per_thread_elements_61 +
-                                                srem32(16 -
-                                                       srem32(per_thread_elements_61,
-                                                              16), 16),
-                                                num_threads_58 + srem32(16 -
-                                                                        srem32(num_threads_58,
-                                                                               16),
-                                                                        16), 1};
-        const size_t local_work_size_225[3] = {16, 16, 1};
-        int64_t time_start_222, time_end_223;
-        
-        if (cl_debug) {
-            fprintf(stderr, "Launching %s with global work size [",
-                    "fut_kernel_map_transpose_i32");
-            fprintf(stderr, "%zu", global_work_size_221[0]);
-            fprintf(stderr, ", ");
-            fprintf(stderr, "%zu", global_work_size_221[1]);
-            fprintf(stderr, ", ");
-            fprintf(stderr, "%zu", global_work_size_221[2]);
-            fprintf(stderr, "].\n");
-            time_start_222 = get_wall_time();
-        }
-        OPENCL_SUCCEED(clEnqueueNDRangeKernel(fut_cl_queue,
-                                              fut_kernel_map_transpose_i32, 3,
-                                              NULL, global_work_size_221,
-                                              local_work_size_225, 0, NULL,
-                                              NULL));
-        if (cl_debug) {
-            OPENCL_SUCCEED(clFinish(fut_cl_queue));
-            time_end_223 = get_wall_time();
-            
-            long time_diff_224 = time_end_223 - time_start_222;
-            
-            if (detail_timing) {
-                fut_kernel_map_transpose_i32total_runtime += time_diff_224;
-                fut_kernel_map_transpose_i32runs++;
-                fprintf(stderr, "kernel %s runtime: %ldus\n",
-                        "fut_kernel_map_transpose_i32", (int) time_diff_224);
-            }
-        }
-    }
-    
+    int64_t x_60 = size_37 + y_59;
+    int64_t per_thread_elements_61 = squot64(x_60, num_threads_58);
     struct memblock_device mem_147;
     
     mem_147.references = NULL;
-    memblock_alloc_device(&mem_147, bytes_141);
+    memblock_alloc_device(&mem_147, bytes_137);
     
     int32_t x_149 = 4 * num_groups_56;
     int32_t bytes_148 = x_149 * group_size_57;
@@ -2115,21 +2867,26 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
     int32_t total_size_183 = sizeof(int32_t) * group_size_57;
     
     OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 0, total_size_183, NULL));
-    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 1,
-                                  sizeof(per_thread_elements_61),
-                                  &per_thread_elements_61));
+    OPENCL_SUCCEED(set_index_kernel_arg(scan_kernel_62, 1,
+                                        per_thread_elements_61));
     OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 2, sizeof(group_size_57),
                                   &group_size_57));
-    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 3, sizeof(size_37),
-                                  &size_37));
-    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 4, sizeof(mem_145.mem),
-                                  &mem_145.mem));
+    OPENCL_SUCCEED(set_index_kernel_arg(scan_kernel_62, 3, size_37));
+    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 4, sizeof(a_mem_136.mem),
+                                  &a_mem_136.mem));
     OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 5, sizeof(num_threads_58),
                                   &num_threads_58));
     OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 6, sizeof(mem_147.mem),
                                   &mem_147.mem));
     OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 7, sizeof(mem_150.mem),
                                   &mem_150.mem));
+    
+    int32_t tile_depth_189 = scan_tile_depth(group_size_57);
+    
+    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 8, (tile_depth_189 + 1) *
+                                  group_size_57 * sizeof(int32_t), NULL));
+    OPENCL_SUCCEED(clSetKernelArg(scan_kernel_62, 9, sizeof(tile_depth_189),
+                                  &tile_depth_189));
     if (1 * (num_groups_56 * group_size_57) != 0) {
         const size_t global_work_size_226[1] = {num_groups_56 * group_size_57};
         const size_t local_work_size_230[1] = {group_size_57};
@@ -2160,84 +2917,6 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
             }
         }
     }
-    
-    int32_t x_152 = 4 * num_threads_58;
-    int32_t bytes_151 = x_152 * per_thread_elements_61;
-    struct memblock_device mem_153;
-    
-    mem_153.references = NULL;
-    memblock_alloc_device(&mem_153, bytes_151);
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 0,
-                                  sizeof(mem_153.mem), &mem_153.mem));
-    
-    int32_t kernel_arg_231 = 0;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 1,
-                                  sizeof(kernel_arg_231), &kernel_arg_231));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 2,
-                                  sizeof(mem_147.mem), &mem_147.mem));
-    
-    int32_t kernel_arg_232 = 0;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 3,
-                                  sizeof(kernel_arg_232), &kernel_arg_232));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 4,
-                                  sizeof(num_threads_58), &num_threads_58));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 5,
-                                  sizeof(per_thread_elements_61),
-                                  &per_thread_elements_61));
-    
-    int32_t kernel_arg_233 = num_threads_58 * per_thread_elements_61;
-    
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 6,
-                                  sizeof(kernel_arg_233), &kernel_arg_233));
-    OPENCL_SUCCEED(clSetKernelArg(fut_kernel_map_transpose_i32, 7, (16 + 1) *
-                                  16 * sizeof(int32_t), NULL));
-    if (1 * (num_threads_58 + srem32(16 - srem32(num_threads_58, 16), 16)) *
-        (per_thread_elements_61 + srem32(16 - srem32(per_thread_elements_61,
-                                                     16), 16)) * 1 != 0) {
-        const size_t global_work_size_234[3] = {num_threads_58 + srem32(16 -
-                                                                        srem32(num_threads_58,
-                                                                               16),
-                                                                        16),
-                                                per_thread_elements_61 +
-                                                srem32(16 -
-                                                       srem32(per_thread_elements_61,
-                                                              16), 16), 1};
-        const size_t local_work_size_238[3] = {16, 16, 1};
-        int64_t time_start_235, time_end_236;
-        
-        if (cl_debug) {
-            fprintf(stderr, "Launching %s with global work size [",
-                    "fut_kernel_map_transpose_i32");
-            fprintf(stderr, "%zu", global_work_size_234[0]);
-            fprintf(stderr, ", ");
-            fprintf(stderr, "%zu", global_work_size_234[1]);
-            fprintf(stderr, ", ");
-            fprintf(stderr, "%zu", global_work_size_234[2]);
-            fprintf(stderr, "].\n");
-            time_start_235 = get_wall_time();
-        }
-        OPENCL_SUCCEED(clEnqueueNDRangeKernel(fut_cl_queue,
-                                              fut_kernel_map_transpose_i32, 3,
-                                              NULL, global_work_size_234,
-                                              local_work_size_238, 0, NULL,
-                                              NULL));
-        if (cl_debug) {
-            OPENCL_SUCCEED(clFinish(fut_cl_queue));
-            time_end_236 = get_wall_time();
-            
-            long time_diff_237 = time_end_236 - time_start_235;
-            
-            if (detail_timing) {
-                fut_kernel_map_transpose_i32total_runtime += time_diff_237;
-                fut_kernel_map_transpose_i32runs++;
-                fprintf(stderr, "kernel %s runtime: %ldus\n",
-                        "fut_kernel_map_transpose_i32", (int) time_diff_237);
-            }
-        }
-    }
-    
     int32_t last_in_group_index_73 = group_size_57 - 1;
     struct memblock_device mem_155;
     
@@ -2344,6 +3023,10 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
             }
         }
     }
+    if (memory_plan) {
+        memblock_unref_device(&mem_155);
+        memblock_unref_device(&mem_157);
+    }
     
     struct memblock_device mem_163;
     
@@ -2397,6 +3080,10 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
             }
         }
     }
+    if (memory_plan) {
+        memblock_unref_device(&mem_150);
+        memblock_unref_device(&mem_160);
+    }
     
     struct memblock_device mem_165;
     
@@ -2404,19 +3091,17 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
     memblock_alloc_device(&mem_165, bytes_137);
     
     int32_t group_size_210;
-    int32_t num_groups_211;
+    int64_t num_groups_211;
     
     group_size_210 = cl_group_size;
-    num_groups_211 = squot32(size_37 + group_size_210 - 1, group_size_210);
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 0, sizeof(mem_153.mem),
-                                  &mem_153.mem));
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 1,
-                                  sizeof(per_thread_elements_61),
-                                  &per_thread_elements_61));
+    num_groups_211 = squot64(size_37 + group_size_210 - 1, group_size_210);
+    OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 0, sizeof(mem_147.mem),
+                                  &mem_147.mem));
+    OPENCL_SUCCEED(set_index_kernel_arg(map_kernel_104, 1,
+                                        per_thread_elements_61));
     OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 2, sizeof(group_size_57),
                                   &group_size_57));
-    OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 3, sizeof(size_37),
-                                  &size_37));
+    OPENCL_SUCCEED(set_index_kernel_arg(map_kernel_104, 3, size_37));
     OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 4, sizeof(mem_163.mem),
                                   &mem_163.mem));
     OPENCL_SUCCEED(clSetKernelArg(map_kernel_104, 5, sizeof(mem_165.mem),
@@ -2452,24 +3137,23 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
             }
         }
     }
+    if (memory_plan) {
+        memblock_unref_device(&mem_147);
+        memblock_unref_device(&mem_163);
+    }
     memblock_set_device(&out_mem_166, &mem_165);
     out_arrsize_168 = size_37;
     out_memsize_167 = bytes_137;
     
-    struct tuple_int32_t_device_mem_int32_t retval_212;
+    struct tuple_int64_t_device_mem_int64_t retval_212;
     
     retval_212.elem_0 = out_memsize_167;
     retval_212.elem_1.references = NULL;
     memblock_set_device(&retval_212.elem_1, &out_mem_166);
     retval_212.elem_2 = out_arrsize_168;
     memblock_unref_device(&out_mem_166);
-    memblock_unref_device(&mem_138);
-    memblock_unref_device(&mem_140);
-    memblock_unref_device(&mem_142);
-    memblock_unref_device(&mem_145);
     memblock_unref_device(&mem_147);
     memblock_unref_device(&mem_150);
-    memblock_unref_device(&mem_153);
     memblock_unref_device(&mem_155);
     memblock_unref_device(&mem_157);
     memblock_unref_device(&mem_160);
@@ -2477,263 +3161,2841 @@ struct tuple_int32_t_device_mem_int32_t futhark_main(int32_t a_mem_size_135,
     memblock_unref_device(&mem_165);
     return retval_212;
 }
-struct array_reader {
-  char* elems;
-  int64_t n_elems_space;
-  int64_t elem_size;
-  int64_t n_elems_used;
-  int64_t *shape;
-  int (*elem_reader)(void*);
+/* Buffered input.
+
+   The readers below pull input through a large buffer rather than
+   through stdio one character at a time.  When the input is a regular
+   file it is memory-mapped and the mapping itself serves as the
+   buffer.  The read position is per thread, so that parallel parsing
+   can point each thread's readers at its own range of the input. */
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+
+struct input_buffer {
+  const unsigned char *pos;     // Next unread byte.
+  const unsigned char *end;     // End of the buffered data.
+  unsigned char *buf;           // NULL when reading from a mapping.
+  int fd;
+  int eof;
+  int eof_in_comment;           // Set when a comment runs into the end.
 };
 
-static int peekc() {
-  int c = getchar();
-  ungetc(c,stdin);
-  return c;
-}
+static __thread struct input_buffer input;
+static const char *input_map = NULL;
+static size_t input_map_size = 0;
 
-static int next_is_not_constituent() {
-  int c = peekc();
-  return c == EOF || !isalnum(c);
-}
+/* Compressed input.
 
-static void skipspaces() {
-  int c = getchar();
-  if (isspace(c)) {
-    skipspaces();
-  } else if (c == '-' && peekc() == '-') {
-    // Skip to end of line.
-    for (; c != '\n' && c != EOF; c = getchar());
-    // Next line may have more spaces.
-    skipspaces();
-  } else if (c != EOF) {
-    ungetc(c, stdin);
+   Input that starts with a gzip or zstd magic number is decompressed
+   on a background thread into a ring buffer, from which the readers
+   refill their own buffer, so that decompression overlaps with
+   parsing.  The thread takes the compressed bytes from the mapping if
+   the input is mapped, and otherwise reads them from the descriptor.
+   zstd support requires building with -DFUTHARK_ZSTD and -lzstd. */
+
+#define DECOMPRESS_RING_SIZE (4 << 20)
+// Most output produced before handing it to the readers.
+#define DECOMPRESS_STEP (256 << 10)
+
+struct decompressor {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const char *format;
+  unsigned char *ring;
+  uint64_t head;                // Bytes produced.
+  uint64_t tail;                // Bytes consumed.
+  int done;
+  int stop;                     // Set when the readers give up on the input.
+  const char *error;
+  // Compressed input not yet handed to the decompressor.
+  int fd;
+  const unsigned char *src;
+  const unsigned char *src_end;
+  unsigned char *src_buf;       // NULL when reading from the mapping.
+  int src_eof;
+  int64_t wait_us;              // Time the readers spent waiting.
+  int joined;
+};
+
+static struct decompressor *decompressor = NULL;
+
+/* Returns the next chunk of compressed input in *p and its size, or 0
+   at the end of the input. */
+static size_t decompress_source(struct decompressor *d, const unsigned char **p) {
+  size_t n;
+
+  while (d->src == d->src_end && !d->src_eof) {
+    ssize_t got = read(d->fd, d->src_buf, INPUT_BUFFER_SIZE);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      d->error = strerror(errno);
+    }
+    if (got <= 0) {
+      d->src_eof = 1;
+    } else {
+      d->src = d->src_buf;
+      d->src_end = d->src_buf + got;
+    }
   }
-}
 
-static int read_elem(struct array_reader *reader) {
-  int ret;
-  if (reader->n_elems_used == reader->n_elems_space) {
-    reader->n_elems_space *= 2;
-    reader->elems = (char*) realloc(reader->elems,
-                                    reader->n_elems_space * reader->elem_size);
+  n = d->src_end - d->src;
+  if (n > INPUT_BUFFER_SIZE) {
+    n = INPUT_BUFFER_SIZE;
   }
+  *p = d->src;
+  d->src += n;
+  return n;
+}
 
-  ret = reader->elem_reader(reader->elems + reader->n_elems_used * reader->elem_size);
+/* Waits for free space in the ring, stores its start in *p and returns
+   its size, which is 0 if the readers have stopped. */
+static size_t decompress_space(struct decompressor *d, unsigned char **p) {
+  size_t n, contiguous;
 
-  if (ret == 0) {
-    reader->n_elems_used++;
+  pthread_mutex_lock(&d->lock);
+  while (d->head - d->tail == DECOMPRESS_RING_SIZE && !d->stop) {
+    pthread_cond_wait(&d->cond, &d->lock);
   }
+  n = d->stop ? 0 : DECOMPRESS_RING_SIZE - (d->head - d->tail);
+  pthread_mutex_unlock(&d->lock);
 
-  return ret;
+  contiguous = DECOMPRESS_RING_SIZE - d->head % DECOMPRESS_RING_SIZE;
+  if (n > contiguous) {
+    n = contiguous;
+  }
+  if (n > DECOMPRESS_STEP) {
+    n = DECOMPRESS_STEP;
+  }
+  *p = d->ring + d->head % DECOMPRESS_RING_SIZE;
+  return n;
 }
 
-static int read_array_elems(struct array_reader *reader, int dims) {
-  int c;
-  int ret;
-  int first = 1;
-  char *knows_dimsize = (char*) calloc(dims,sizeof(char));
-  int cur_dim = dims-1;
-  int64_t *elems_read_in_dim = (int64_t*) calloc(dims,sizeof(int64_t));
-  while (1) {
-    skipspaces();
+static void decompress_produced(struct decompressor *d, size_t n) {
+  pthread_mutex_lock(&d->lock);
+  d->head += n;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+}
 
-    c = getchar();
-    if (c == ']') {
-      if (knows_dimsize[cur_dim]) {
-        if (reader->shape[cur_dim] != elems_read_in_dim[cur_dim]) {
-          ret = 1;
-          break;
-        }
-      } else {
-        knows_dimsize[cur_dim] = 1;
-        reader->shape[cur_dim] = elems_read_in_dim[cur_dim];
-      }
-      if (cur_dim == 0) {
-        ret = 0;
-        break;
-      } else {
-        cur_dim--;
-        elems_read_in_dim[cur_dim]++;
-      }
-    } else if (c == ',') {
-      skipspaces();
-      c = getchar();
-      if (c == '[') {
-        if (cur_dim == dims - 1) {
-          ret = 1;
-          break;
-        }
-        first = 1;
-        cur_dim++;
-        elems_read_in_dim[cur_dim] = 0;
-      } else if (cur_dim == dims - 1) {
-        ungetc(c, stdin);
-        ret = read_elem(reader);
-        if (ret != 0) {
-          break;
-        }
-        elems_read_in_dim[cur_dim]++;
-      } else {
-        ret = 1;
+static void decompress_finish(struct decompressor *d) {
+  pthread_mutex_lock(&d->lock);
+  d->done = 1;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+}
+
+static void *gzip_thread(void *arg) {
+  struct decompressor *d = arg;
+  z_stream zs;
+  int ret = Z_OK, src_done = 0;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    d->error = "cannot initialise zlib";
+    decompress_finish(d);
+    return NULL;
+  }
+
+  while (d->error == NULL) {
+    unsigned char *out;
+    size_t space;
+
+    if (zs.avail_in == 0 && !src_done) {
+      const unsigned char *p;
+      zs.avail_in = decompress_source(d, &p);
+      zs.next_in = (unsigned char*)p;
+      src_done = zs.avail_in == 0;
+    }
+    if (ret == Z_STREAM_END) {
+      if (zs.avail_in == 0) {
         break;
       }
-    } else if (c == EOF) {
-      ret = 1;
-      break;
-    } else if (first) {
-      if (c == '[') {
-        if (cur_dim == dims - 1) {
-          ret = 1;
-          break;
-        }
-        cur_dim++;
-        elems_read_in_dim[cur_dim] = 0;
-      } else {
-        ungetc(c, stdin);
-        ret = read_elem(reader);
-        if (ret != 0) {
-          break;
-        }
-        elems_read_in_dim[cur_dim]++;
-        first = 0;
-      }
-    } else {
-      ret = 1;
+      // Another gzip member follows.
+      inflateReset(&zs);
+      ret = Z_OK;
+    }
+    if ((space = decompress_space(d, &out)) == 0) {
       break;
     }
+    zs.next_out = out;
+    zs.avail_out = space;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    decompress_produced(d, space - zs.avail_out);
+    if (ret == Z_BUF_ERROR && src_done) {
+      d->error = "unexpected end of gzip input";
+    } else if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      d->error = zs.msg != NULL ? zs.msg : "corrupt gzip input";
+    }
   }
 
-  free(knows_dimsize);
-  free(elems_read_in_dim);
-  return ret;
+  inflateEnd(&zs);
+  decompress_finish(d);
+  return NULL;
 }
 
-static int read_array(int64_t elem_size, int (*elem_reader)(void*),
-               void **data, int64_t *shape, int64_t dims) {
-  int ret;
-  struct array_reader reader;
-  int64_t read_dims = 0;
-  while (1) {
-    int c;
-    skipspaces();
-    c = getchar();
-    if (c=='[') {
-      read_dims++;
-    } else {
-      if (c != EOF) {
-        ungetc(c, stdin);
-      }
-      break;
-    }
+#ifdef FUTHARK_ZSTD
+static void *zstd_thread(void *arg) {
+  struct decompressor *d = arg;
+  ZSTD_DStream *zs = ZSTD_createDStream();
+  ZSTD_inBuffer in = { NULL, 0, 0 };
+  size_t ret = 0;               // Zero at frame boundaries.
+  int src_done = 0;
+
+  if (zs == NULL || ZSTD_isError(ZSTD_initDStream(zs))) {
+    d->error = "cannot initialise zstd";
+  }
+
+  while (d->error == NULL) {
+    ZSTD_outBuffer out;
+    unsigned char *p;
+
+    if (in.pos == in.size && !src_done) {
+      const unsigned char *src;
+      in.size = decompress_source(d, &src);
+      in.src = src;
+      in.pos = 0;
+      src_done = in.size == 0;
+    }
+    if (src_done && in.pos == in.size && ret == 0) {
+      break;
+    }
+    if ((out.size = decompress_space(d, &p)) == 0) {
+      break;
+    }
+    out.dst = p;
+    out.pos = 0;
+    ret = ZSTD_decompressStream(zs, &out, &in);
+    decompress_produced(d, out.pos);
+    if (ZSTD_isError(ret)) {
+      d->error = ZSTD_getErrorName(ret);
+    } else if (src_done && ret != 0 && out.pos < out.size) {
+      d->error = "unexpected end of zstd input";
+    }
+  }
+
+  ZSTD_freeDStream(zs);
+  decompress_finish(d);
+  return NULL;
+}
+#endif
+
+/* Reads up to n bytes of decompressed input, waiting for the thread to
+   produce them.  Returns 0 at the end of the input. */
+static size_t decompress_read(void *dest, size_t n) {
+  struct decompressor *d = decompressor;
+  size_t avail, offset, first;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head == d->tail && !d->done) {
+    int64_t t0 = get_wall_time();
+    while (d->head == d->tail && !d->done) {
+      pthread_cond_wait(&d->cond, &d->lock);
+    }
+    d->wait_us += get_wall_time() - t0;
+  }
+  if (d->error != NULL) {
+    panic(1, "Cannot decompress %s input: %s\n", d->format, d->error);
+  }
+  avail = d->head - d->tail;
+  pthread_mutex_unlock(&d->lock);
+
+  if (avail == 0) {
+    if (!d->joined) {
+      pthread_join(d->thread, NULL);
+      d->joined = 1;
+      if (cl_debug) {
+        fprintf(stderr, "Decompressed %lu bytes of %s input on a background thread; readers waited %ldus for it.\n",
+                (unsigned long)d->head, d->format, (long)d->wait_us);
+      }
+    }
+    return 0;
+  }
+
+  // The thread does not touch the unconsumed part of the ring.
+  if (n > avail) {
+    n = avail;
+  }
+  offset = d->tail % DECOMPRESS_RING_SIZE;
+  first = n < DECOMPRESS_RING_SIZE - offset ? n : DECOMPRESS_RING_SIZE - offset;
+  memcpy(dest, d->ring + offset, first);
+  memcpy((char*)dest + first, d->ring, n - first);
+
+  pthread_mutex_lock(&d->lock);
+  d->tail += n;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  return n;
+}
+
+static void decompress_end() {
+  struct decompressor *d = decompressor;
+
+  if (d == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  if (!d->joined) {
+    pthread_join(d->thread, NULL);
+  }
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->cond);
+  free(d->ring);
+  free(d->src_buf);
+  free(d);
+  decompressor = NULL;
+}
+
+/* Reads up to n bytes of input, from the decompressor if there is one.
+   Returns 0 at the end of the input. */
+static size_t input_raw_read(void *dest, size_t n) {
+  if (decompressor != NULL) {
+    return decompress_read(dest, n);
+  }
+  for (;;) {
+    ssize_t got = read(input.fd, dest, n);
+    if (got >= 0) {
+      return got;
+    }
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+}
+
+/* Reads input from fd, starting at its current position. */
+static void input_from_fd(int fd) {
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      offset >= 0 && st.st_size > offset) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      input_map = map;
+      input_map_size = st.st_size;
+      input.pos = (const unsigned char*)map + offset;
+      input.end = (const unsigned char*)map + st.st_size;
+      input.buf = NULL;
+      input.fd = fd;
+      input.eof = 1;
+      return;
+    }
+  }
+
+  input.buf = malloc(INPUT_BUFFER_SIZE);
+  input.pos = input.end = input.buf;
+  input.fd = fd;
+  input.eof = 0;
+}
+
+static void input_close() {
+  decompress_end();
+  if (input_map != NULL) {
+    munmap((void*)input_map, input_map_size);
+    input_map = NULL;
+    input_map_size = 0;
+  }
+  free(input.buf);
+  input.buf = NULL;
+  close(input.fd);
+}
+
+static void input_cache_prepare(const char *path, int fd);
+static void input_start_decompression();
+
+static void open_input(const char *path) {
+  int fd = 0;
+
+  if (path != NULL && (fd = open(path, O_RDONLY)) < 0) {
+    panic(1, "Cannot open %s: %s\n", path, strerror(errno));
+  }
+  if (path != NULL) {
+    input_cache_prepare(path, fd);
+  }
+  input_from_fd(fd);
+  input_start_decompression();
+}
+
+static int input_is_mapped(const void *p) {
+  return input_map != NULL &&
+    (const char*)p >= input_map && (const char*)p < input_map + input_map_size;
+}
+
+static size_t input_refill(size_t n) {
+  size_t avail = input.end - input.pos;
+
+  // Keep one byte of history so that input_ungetc() works after a refill.
+  size_t keep = input.pos > input.buf ? 1 : 0;
+  memmove(input.buf, input.pos - keep, avail + keep);
+  input.pos = input.buf + keep;
+  input.end = input.pos + avail;
+
+  while ((size_t)(input.end - input.pos) < n && !input.eof) {
+    size_t used = input.end - input.buf;
+    size_t got = input_raw_read(input.buf + used, INPUT_BUFFER_SIZE - used);
+    if (got == 0) {
+      input.eof = 1;
+    } else {
+      input.end += got;
+    }
+  }
+
+  return input.end - input.pos;
+}
+
+/* Makes sure that at least n bytes (n being much smaller than the
+   buffer) are buffered past the read position, unless the input ends
+   first.  Returns the number of buffered bytes. */
+static inline size_t input_fill(size_t n) {
+  size_t avail = input.end - input.pos;
+
+  if (avail >= n || input.eof) {
+    return avail;
+  }
+  return input_refill(n);
+}
+
+static inline int input_peekc() {
+  if (input.pos == input.end && input_fill(1) == 0) {
+    return EOF;
+  }
+  return *input.pos;
+}
+
+static inline int input_getc() {
+  if (input.pos == input.end && input_fill(1) == 0) {
+    return EOF;
+  }
+  return *input.pos++;
+}
+
+static inline void input_ungetc(int c) {
+  if (c != EOF) {
+    input.pos--;
+  }
+}
+
+/* Copies the next n bytes of input to dest.  Returns the number of
+   bytes copied, which is less than n only at the end of input. */
+static size_t input_read(void *dest, size_t n) {
+  size_t done = 0;
+
+  while (done < n) {
+    size_t avail = input.end - input.pos;
+    if (avail == 0) {
+      if (input.eof) {
+        break;
+      }
+      // Large reads bypass the buffer.
+      if (n - done >= INPUT_BUFFER_SIZE / 2) {
+        size_t got = input_raw_read((char*)dest + done, n - done);
+        if (got == 0) {
+          input.eof = 1;
+        } else {
+          done += got;
+        }
+        continue;
+      }
+      avail = input_fill(1);
+      continue;
+    }
+    if (avail > n - done) {
+      avail = n - done;
+    }
+    memcpy((char*)dest + done, input.pos, avail);
+    input.pos += avail;
+    done += avail;
+  }
+
+  return done;
+}
+
+/* Reads the rest of the input into the buffer, which grows as needed.
+   Afterwards all remaining input is in memory. */
+static void input_slurp() {
+  size_t pos = input.pos - input.buf, used = input.end - input.buf;
+  size_t space = INPUT_BUFFER_SIZE;
+
+  while (!input.eof) {
+    if (used == space) {
+      space *= 2;
+      input.buf = realloc(input.buf, space);
+    }
+    size_t got = input_raw_read(input.buf + used, space - used);
+    if (got == 0) {
+      input.eof = 1;
+    } else {
+      used += got;
+    }
+  }
+
+  input.pos = input.buf + pos;
+  input.end = input.buf + used;
+}
+
+/* Starts decompressing the input on a background thread if it is
+   compressed. */
+static void input_start_decompression() {
+  static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+  static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+  size_t avail = input_fill(sizeof(zstd_magic));
+  void *(*run)(void*);
+  const char *format;
+  struct decompressor *d;
+
+  if (avail >= sizeof(gzip_magic) &&
+      memcmp(input.pos, gzip_magic, sizeof(gzip_magic)) == 0) {
+    run = gzip_thread;
+    format = "gzip";
+  } else if (avail >= sizeof(zstd_magic) &&
+             memcmp(input.pos, zstd_magic, sizeof(zstd_magic)) == 0) {
+#ifdef FUTHARK_ZSTD
+    run = zstd_thread;
+    format = "zstd";
+#else
+    panic(1, "Input is zstd-compressed, but zstd support was not compiled in (-DFUTHARK_ZSTD -lzstd).\n");
+#endif
+  } else {
+    return;
+  }
+
+  d = calloc(1, sizeof(struct decompressor));
+  d->format = format;
+  d->ring = malloc(DECOMPRESS_RING_SIZE);
+  d->fd = input.fd;
+  d->src_eof = input.eof;
+  if (input.buf == NULL) {
+    d->src = input.pos;
+    d->src_end = input.end;
+    input.buf = malloc(INPUT_BUFFER_SIZE);
+  } else {
+    d->src_buf = malloc(INPUT_BUFFER_SIZE);
+    memcpy(d->src_buf, input.pos, avail);
+    d->src = d->src_buf;
+    d->src_end = d->src_buf + avail;
+  }
+  input.pos = input.end = input.buf;
+  input.eof = 0;
+
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->cond, NULL);
+  if (pthread_create(&d->thread, NULL, run, d) != 0) {
+    panic(1, "Cannot create decompression thread: %s\n", strerror(errno));
+  }
+  decompressor = d;
+  if (cl_debug) {
+    fprintf(stderr, "Decompressing %s input on a background thread.\n", format);
+  }
+}
+
+struct array_reader {
+  char* elems;
+  int64_t n_elems_space;
+  int64_t elem_size;
+  int64_t n_elems_used;
+  int64_t *shape;
+  int (*elem_reader)(void*);
+  // If not NULL, called instead of growing the buffer when it is full,
+  // to empty it.  Reading fails if it returns non-zero.
+  int (*flush)(struct array_reader*);
+  void *flush_arg;
+};
+
+static int peekc() {
+  return input_peekc();
+}
+
+static int next_is_not_constituent() {
+  int c = input_peekc();
+  return c == EOF || !isalnum(c);
+}
+
+static inline int is_space(int c) {
+  // Same as isspace() in the C locale.
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static void skipspaces() {
+  if (input.pos < input.end && !is_space(*input.pos) && *input.pos != '-') {
+    return;
+  }
+  while (1) {
+    const unsigned char *p = input.pos, *end = input.end;
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    input.pos = p;
+    if (p == end) {
+      if (input_fill(1) == 0) {
+        return;
+      }
+    } else if (*p == '-' && input_fill(2) >= 2 && input.pos[1] == '-') {
+      // Skip to end of line; the next line may have more spaces.
+      while (1) {
+        const unsigned char *nl = memchr(input.pos, '\n', input.end - input.pos);
+        if (nl != NULL) {
+          input.pos = nl + 1;
+          break;
+        }
+        input.pos = input.end;
+        if (input_fill(1) == 0) {
+          input.eof_in_comment = 1;
+          return;
+        }
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+/* Consumes the longest prefix of 'lit' that the input starts with, as
+   scanf() does for literal characters in a format string. */
+static void lex_literal(const char *lit) {
+  for (; *lit != '\0' && input_peekc() == (unsigned char)*lit; lit++) {
+    input.pos++;
+  }
+}
+
+static inline int digit_value(int c, int base) {
+  int d;
+  if (c >= '0' && c <= '9') {
+    d = c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    d = c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    d = c - 'A' + 10;
+  } else {
+    return -1;
+  }
+  return d < base ? d : -1;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Number of leading decimal digits in the 16 bytes at p. */
+static inline int decimal_run16(const unsigned char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  __m128i ge0 = _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1));
+  __m128i le9 = _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1));
+  int mask = _mm_movemask_epi8(_mm_and_si128(ge0, le9));
+  return __builtin_ctz(~mask);
+}
+#endif
+
+/* Accumulates digits in the given base into *mag, setting *overflow if
+   the magnitude does not fit in 64 bits.  Returns the number of digits
+   consumed. */
+static int64_t lex_digits(int base, uint64_t *mag, int *overflow) {
+  int64_t n = 0;
+  uint64_t x = *mag;
+
+  while (1) {
+    const unsigned char *p = input.pos, *end = input.end;
+
+    if (base == 10) {
+      // Find the run of digits first, then convert it without
+      // re-classifying each character.
+      const unsigned char *q = p;
+#ifdef __SSE2__
+      while (end - q >= 16) {
+        int run = decimal_run16(q);
+        q += run;
+        if (run < 16) {
+          break;
+        }
+      }
+#endif
+      while (q < end && *q >= '0' && *q <= '9') {
+        q++;
+      }
+      if (q - p <= 19 && x == 0) {
+        for (; p < q; p++) {
+          x = x * 10 + (*p - '0');
+        }
+      } else {
+        for (; p < q; p++) {
+          if (__builtin_mul_overflow(x, 10, &x) ||
+              __builtin_add_overflow(x, (uint64_t)(*p - '0'), &x)) {
+            *overflow = 1;
+          }
+        }
+      }
+      n += q - input.pos;
+      input.pos = q;
+    } else {
+      int d;
+      for (; p < end && (d = digit_value(*p, base)) >= 0; p++) {
+        if (__builtin_mul_overflow(x, (uint64_t)base, &x) ||
+            __builtin_add_overflow(x, (uint64_t)d, &x)) {
+          *overflow = 1;
+        }
+      }
+      n += p - input.pos;
+      input.pos = p;
+    }
+
+    if (input.pos < input.end || input_fill(1) == 0) {
+      break;
+    }
+  }
+
+  *mag = x;
+  return n;
+}
+
+/* Reads an integer in the syntax accepted by scanf("%i"): an optional
+   sign followed by a hexadecimal (0x), octal (leading 0) or decimal
+   number.  Like strtol(), out-of-range values saturate to the int64_t
+   range; narrower types are then truncated, as scanf() does. */
+static int lex_integer(int64_t *dest) {
+  int negative = 0, overflow = 0;
+  uint64_t mag = 0;
+  int c;
+
+  input_fill(64);
+  c = input_peekc();
+  if (c == '-' || c == '+') {
+    negative = c == '-';
+    input.pos++;
+    c = input_peekc();
+  }
+
+  if (c == '0') {
+    input.pos++;
+    c = input_peekc();
+    if (c == 'x' || c == 'X') {
+      // A "0x" without hex digits is still read as 0.
+      input.pos++;
+      lex_digits(16, &mag, &overflow);
+    } else {
+      lex_digits(8, &mag, &overflow);
+    }
+  } else if (lex_digits(10, &mag, &overflow) == 0) {
+    return 1;
+  }
+
+  if (negative) {
+    *dest = (overflow || mag > (uint64_t)INT64_MAX + 1) ? INT64_MIN : (int64_t)-mag;
+  } else {
+    *dest = (overflow || mag > INT64_MAX) ? INT64_MAX : (int64_t)mag;
+  }
+  return 0;
+}
+
+/* Reads a floating-point number with sscanf(), so the accepted syntax
+   is exactly that of scanf().  Literals that do not fit in the buffer
+   are syntax errors rather than being cut short. */
+static int lex_float(const char *fmt, void *dest) {
+  char buf[128];
+  size_t n = input_fill(sizeof(buf) - 1);
+  int consumed = 0;
+
+  if (n > sizeof(buf) - 1) {
+    n = sizeof(buf) - 1;
+  }
+  memcpy(buf, input.pos, n);
+  buf[n] = '\0';
+  if (sscanf(buf, fmt, dest, &consumed) != 1) {
+    return 1;
+  }
+  // A literal that fills the whole buffer may have been cut short.
+  if ((size_t)consumed == sizeof(buf) - 1) {
+    return 1;
+  }
+  input.pos += consumed;
+  return 0;
+}
+
+static int read_elem(struct array_reader *reader) {
+  int ret;
+  if (reader->n_elems_used == reader->n_elems_space) {
+    if (reader->flush != NULL) {
+      if (reader->flush(reader) != 0) {
+        return 1;
+      }
+    } else {
+      char *elems = host_grow(reader->elems, reader->n_elems_used * reader->elem_size,
+                              2 * reader->n_elems_space * reader->elem_size);
+      if (elems == NULL) {
+        return 1;
+      }
+      reader->elems = elems;
+      reader->n_elems_space *= 2;
+    }
+  }
+
+  ret = reader->elem_reader(reader->elems + reader->n_elems_used * reader->elem_size);
+
+  if (ret == 0) {
+    reader->n_elems_used++;
+  }
+
+  return ret;
+}
+
+static int read_array_elems(struct array_reader *reader, int dims) {
+  int c;
+  int ret;
+  int first = 1;
+  char *knows_dimsize = (char*) calloc(dims,sizeof(char));
+  int cur_dim = dims-1;
+  int64_t *elems_read_in_dim = (int64_t*) calloc(dims,sizeof(int64_t));
+  while (1) {
+    skipspaces();
+
+    c = input_getc();
+    if (c == ']') {
+      if (knows_dimsize[cur_dim]) {
+        if (reader->shape[cur_dim] != elems_read_in_dim[cur_dim]) {
+          ret = 1;
+          break;
+        }
+      } else {
+        knows_dimsize[cur_dim] = 1;
+        reader->shape[cur_dim] = elems_read_in_dim[cur_dim];
+      }
+      if (cur_dim == 0) {
+        ret = 0;
+        break;
+      } else {
+        cur_dim--;
+        elems_read_in_dim[cur_dim]++;
+      }
+    } else if (c == ',') {
+      skipspaces();
+      c = input_getc();
+      if (c == '[') {
+        if (cur_dim == dims - 1) {
+          ret = 1;
+          break;
+        }
+        first = 1;
+        cur_dim++;
+        elems_read_in_dim[cur_dim] = 0;
+      } else if (cur_dim == dims - 1) {
+        input_ungetc(c);
+        ret = read_elem(reader);
+        if (ret != 0) {
+          break;
+        }
+        elems_read_in_dim[cur_dim]++;
+      } else {
+        ret = 1;
+        break;
+      }
+    } else if (c == EOF) {
+      ret = 1;
+      break;
+    } else if (first) {
+      if (c == '[') {
+        if (cur_dim == dims - 1) {
+          ret = 1;
+          break;
+        }
+        cur_dim++;
+        elems_read_in_dim[cur_dim] = 0;
+      } else {
+        input_ungetc(c);
+        ret = read_elem(reader);
+        if (ret != 0) {
+          break;
+        }
+        elems_read_in_dim[cur_dim]++;
+        first = 0;
+      }
+    } else {
+      ret = 1;
+      break;
+    }
+  }
+
+  free(knows_dimsize);
+  free(elems_read_in_dim);
+  return ret;
+}
+
+/* Parallel parsing.
+
+   Large one-dimensional textual arrays may be parsed by several threads
+   at once.  The whole input is brought into memory and split at element
+   separators into one range per thread.  The threads first count the
+   elements in their ranges, and once the destination has been allocated
+   they parse their ranges directly into their part of it.  Splitting
+   does not know about comments, so a range that ends inside one is
+   treated as a failure, as is any syntax error.  On failure the array
+   is parsed again serially by read_array_elems(), so the accepted
+   language is the same whatever the number of threads. */
+
+#define PARSE_MIN_BYTES_PER_THREAD (64 * 1024)
+#define PARSE_MAX_THREADS 256
+
+static int num_parse_threads = 1;
+
+struct parse_range {
+  const unsigned char *start;   // The first range starts with an element,
+  const unsigned char *end;     // the others with a ','.
+  int first, last;
+  struct array_reader *reader;
+  int64_t n_elems;              // Counted, then parsed, elements.
+  int64_t offset;               // Index of the first element.
+  const unsigned char *stop;    // Past the closing ']', in the last range.
+  int ret;
+};
+
+static void *count_range(void *arg) {
+  struct parse_range *r = (struct parse_range*) arg;
+  const unsigned char *p = r->start, *end = r->end;
+  int64_t n = r->first;
+
+  while (p < end) {
+    const unsigned char *dash = memchr(p, '-', end - p);
+    const unsigned char *stop = dash != NULL ? dash : end;
+
+    for (; p < stop; p++) {
+      n += *p == ',';
+    }
+    if (dash == NULL) {
+      break;
+    }
+    if (dash + 1 < end && dash[1] == '-') {
+      const unsigned char *nl = memchr(dash, '\n', end - dash);
+      p = nl != NULL ? nl + 1 : end;
+    } else {
+      p = dash + 1;
+    }
+  }
+
+  // An upper bound, as the last range may go on past the ']'.
+  r->n_elems = n;
+  return NULL;
+}
+
+static void *parse_range(void *arg) {
+  struct parse_range *r = (struct parse_range*) arg;
+  int (*elem_reader)(void*) = r->reader->elem_reader;
+  int64_t elem_size = r->reader->elem_size;
+  char *dest = r->reader->elems + r->offset * elem_size;
+  int64_t n = 0;
+
+  input.pos = r->start;
+  input.end = r->end;
+  input.buf = NULL;
+  input.eof = 1;
+  input.eof_in_comment = 0;
+
+  r->ret = 1;
+  if (r->first) {
+    if (r->n_elems == 0 || elem_reader(dest) != 0) {
+      return NULL;
+    }
+    n++;
+  }
+  while (1) {
+    skipspaces();
+    int c = input_getc();
+    if (c == ',') {
+      if (n == r->n_elems || elem_reader(dest + n * elem_size) != 0) {
+        return NULL;
+      }
+      n++;
+    } else if (c == ']' && r->last) {
+      r->stop = input.pos;
+      break;
+    } else if (c == EOF && !r->last && !input.eof_in_comment) {
+      break;
+    } else {
+      return NULL;
+    }
+  }
+
+  if (!r->last && n != r->n_elems) {
+    return NULL;
+  }
+  r->n_elems = n;
+  r->ret = 0;
+  return NULL;
+}
+
+/* Runs f on every range, one thread per range. */
+static void run_on_ranges(void *(*f)(void*), struct parse_range *ranges, int n) {
+  pthread_t threads[PARSE_MAX_THREADS];
+  char started[PARSE_MAX_THREADS];
+
+  for (int i = 1; i < n; i++) {
+    started[i] = pthread_create(&threads[i], NULL, f, &ranges[i]) == 0;
+    if (!started[i]) {
+      f(&ranges[i]);
+    }
+  }
+  f(&ranges[0]);
+  for (int i = 1; i < n; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+/* Parses the elements of a one-dimensional array in parallel, starting
+   just after the '['.  Returns 1 if the serial reader should be used
+   instead. */
+static int read_array_elems_parallel(struct array_reader *reader) {
+  struct parse_range ranges[PARSE_MAX_THREADS];
+  struct input_buffer saved;
+  const unsigned char *start, *end;
+  int64_t n_elems = 0;
+  int n = num_parse_threads;
+
+  input_slurp();
+  start = input.pos;
+  end = input.end;
+
+  if (n > PARSE_MAX_THREADS) {
+    n = PARSE_MAX_THREADS;
+  }
+  if (n > (end - start) / PARSE_MIN_BYTES_PER_THREAD) {
+    n = (end - start) / PARSE_MIN_BYTES_PER_THREAD;
+  }
+  if (n < 2) {
+    return 1;
+  }
+
+  // Split just before the first ',' past each even share of the input.
+  ranges[0].start = start;
+  for (int i = 1; i < n; i++) {
+    const unsigned char *target = start + (end - start) / n * i;
+    const unsigned char *from = target > ranges[i-1].start ? target : ranges[i-1].start + 1;
+    const unsigned char *sep = from < end ? memchr(from, ',', end - from) : NULL;
+    if (sep == NULL) {
+      n = i;
+      break;
+    }
+    ranges[i-1].end = ranges[i].start = sep;
+  }
+  ranges[n-1].end = end;
+  for (int i = 0; i < n; i++) {
+    ranges[i].first = i == 0;
+    ranges[i].last = i == n - 1;
+    ranges[i].reader = reader;
+  }
+
+  saved = input;
+  run_on_ranges(count_range, ranges, n);
+  for (int i = 0; i < n; i++) {
+    ranges[i].offset = n_elems;
+    n_elems += ranges[i].n_elems;
+  }
+  if (n_elems > reader->n_elems_space) {
+    if (reader->flush != NULL) {
+      // The buffer may not be grown.
+      return 1;
+    }
+    char *elems = host_grow(reader->elems, reader->n_elems_used * reader->elem_size,
+                            n_elems * reader->elem_size);
+    if (elems == NULL) {
+      return 1;
+    }
+    reader->elems = elems;
+    reader->n_elems_space = n_elems;
+  }
+  run_on_ranges(parse_range, ranges, n);
+  input = saved;
+
+  for (int i = 0; i < n; i++) {
+    if (ranges[i].ret != 0) {
+      return 1;
+    }
+  }
+
+  reader->n_elems_used = ranges[n-1].offset + ranges[n-1].n_elems;
+  reader->shape[0] = reader->n_elems_used;
+  input.pos = ranges[n-1].stop;
+  return 0;
+}
+
+static int read_char(void* dest);
+
+/* Reads an array into a reader whose buffer, shape and element reader
+   have been set up, in parallel if allowed and possible. */
+static int read_array_into(struct array_reader *reader, int64_t dims, int parallel) {
+  int64_t read_dims = 0;
+  while (1) {
+    int c;
+    skipspaces();
+    c = input_getc();
+    if (c=='[') {
+      read_dims++;
+    } else {
+      if (c != EOF) {
+        input_ungetc(c);
+      }
+      break;
+    }
   }
 
   if (read_dims != dims) {
     return 1;
   }
 
-  reader.shape = shape;
-  reader.n_elems_used = 0;
-  reader.elem_size = elem_size;
-  reader.n_elems_space = 16;
-  reader.elems = (char*) realloc(*data, elem_size*reader.n_elems_space);
-  reader.elem_reader = elem_reader;
+  // Character elements may themselves be separators, so such arrays are
+  // always read serially.
+  if (parallel && dims == 1 && num_parse_threads > 1 &&
+      reader->elem_reader != read_char && read_array_elems_parallel(reader) == 0) {
+    return 0;
+  }
+  reader->n_elems_used = 0;
+  return read_array_elems(reader, dims);
+}
+
+static int read_array(int64_t elem_size, int (*elem_reader)(void*),
+               void **data, int64_t *shape, int64_t dims) {
+  int ret;
+  struct array_reader reader;
+
+  reader.shape = shape;
+  reader.n_elems_used = 0;
+  reader.elem_size = elem_size;
+  reader.n_elems_space = 16;
+  // Whatever *data held is overwritten.
+  reader.elems = host_grow(*data, 0, elem_size*reader.n_elems_space);
+  if (reader.elems == NULL) {
+    return 1;
+  }
+  reader.elem_reader = elem_reader;
+  reader.flush = NULL;
+
+  ret = read_array_into(&reader, dims, 1);
+
+  *data = reader.elems;
+
+  return ret;
+}
+
+static int read_int8(void* dest) {
+  int64_t x;
+  skipspaces();
+  if (lex_integer(&x) == 0) {
+    *(int8_t*)dest = x;
+    lex_literal("i8");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_int16(void* dest) {
+  int64_t x;
+  skipspaces();
+  if (lex_integer(&x) == 0) {
+    *(int16_t*)dest = x;
+    lex_literal("i16");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_int32(void* dest) {
+  int64_t x;
+  skipspaces();
+  if (lex_integer(&x) == 0) {
+    *(int32_t*)dest = x;
+    lex_literal("i32");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_int64(void* dest) {
+  int64_t x;
+  skipspaces();
+  if (lex_integer(&x) == 0) {
+    *(int64_t*)dest = x;
+    lex_literal("i64");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_char(void* dest) {
+  int c;
+  skipspaces();
+  if ((c = input_getc()) != EOF) {
+    *(char*)dest = c;
+    return 0;
+  } else {
+    return 1;
+  }
+}
+
+static int read_double(void* dest) {
+  skipspaces();
+  if (lex_float("%lf%n", dest) == 0) {
+    lex_literal("f64");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_float(void* dest) {
+  skipspaces();
+  if (lex_float("%f%n", dest) == 0) {
+    lex_literal("f32");
+    return next_is_not_constituent() ? 0 : 1;
+  } else {
+    return 1;
+  }
+}
+
+static int read_bool(void* dest) {
+  skipspaces();
+  if (input_fill(5) >= 4) {
+    if (strncmp((const char*)input.pos, "True", 4) == 0) {
+      input.pos += 4;
+      *(int*)dest = 1;
+      return 0;
+    } else if (strncmp((const char*)input.pos, "Fals", 4) == 0) {
+      input.pos += 4;
+      if (input_getc() == 'e') {
+        *(int*)dest = 0;
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Binary input.
+
+   Besides the textual syntax, arrays may be given in a self-describing
+   binary format: the byte 'b', a format version, the rank as a signed
+   byte, a four-character element type name (" i32", "bool", ...), the
+   shape as rank little-endian 64-bit integers, and finally the
+   elements in little-endian row-major order.  The format is detected
+   automatically.  Binary payloads of memory-mapped inputs are used in
+   place rather than copied. */
+
+#define BINARY_FORMAT_VERSION 2
+
+static int read_is_binary() {
+  skipspaces();
+  return peekc() == 'b';
+}
+
+static int host_is_little_endian() {
+  const uint16_t x = 1;
+  return *(const char*)&x == 1;
+}
+
+static uint64_t le_uint64(const unsigned char *b) {
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--) {
+    x = (x << 8) | b[i];
+  }
+  return x;
+}
+
+static void byteswap_elems(char *elems, int64_t elem_size, int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    char *e = elems + i * elem_size;
+    for (int64_t j = 0; j < elem_size / 2; j++) {
+      char tmp = e[j];
+      e[j] = e[elem_size - 1 - j];
+      e[elem_size - 1 - j] = tmp;
+    }
+  }
+}
+
+/* Encodes the header of a binary array, starting with the 'b', into
+   header.  Returns its size. */
+static size_t encode_binary_header(unsigned char *header, const char *type_name,
+                                   const int64_t *shape, int64_t dims) {
+  header[0] = 'b';
+  header[1] = BINARY_FORMAT_VERSION;
+  header[2] = dims;
+  memcpy(header + 3, type_name, 4);
+  for (int64_t i = 0; i < dims; i++) {
+    for (int j = 0; j < 8; j++) {
+      header[7 + i * 8 + j] = (uint64_t)shape[i] >> (j * 8);
+    }
+  }
+  return 1 + 1 + 1 + 4 + 8 * dims;
+}
+
+/* Returns the first offset from start at which a binary array of the
+   given rank can be put so that its elements are aligned to align
+   bytes.  The gap can be filled with spaces. */
+static off_t binary_array_offset(off_t start, int64_t dims, off_t align) {
+  off_t header_size = 1 + 1 + 1 + 4 + 8 * dims;
+
+  return start + (align - (start + header_size) % align) % align;
+}
+
+/* Decodes the header following the 'b', checking it against the
+   expected type and rank.  Returns the number of payload bytes, or
+   -1. */
+static int64_t decode_binary_header(const unsigned char *header, const char *type_name,
+                                    int64_t elem_size, int64_t *shape, int64_t dims) {
+  if (header[0] != BINARY_FORMAT_VERSION) {
+    return -1;
+  }
+  if ((int8_t)header[1] != dims) {
+    return -1;
+  }
+  if (memcmp(header + 2, type_name, 4) != 0) {
+    return -1;
+  }
+
+  int64_t n_elems = 1;
+  for (int64_t i = 0; i < dims; i++) {
+    uint64_t d = le_uint64(header + 6 + i * 8);
+    if (d > INT64_MAX || (d != 0 && (uint64_t)n_elems > INT64_MAX / elem_size / d)) {
+      return -1;
+    }
+    shape[i] = d;
+    n_elems *= d;
+  }
+  return n_elems * elem_size;
+}
+
+/* Reads the 'b' and the header following it.  Returns the number of
+   payload bytes, or -1. */
+static int64_t read_binary_header(const char *type_name, int64_t elem_size,
+                                  int64_t *shape, int64_t dims) {
+  unsigned char header[1 + 1 + 4 + 8 * 127];
+  size_t header_size = 1 + 1 + 4 + 8 * dims;
+
+  if (input_getc() != 'b') {
+    return -1;
+  }
+  if (input_read(header, header_size) != header_size) {
+    return -1;
+  }
+  return decode_binary_header(header, type_name, elem_size, shape, dims);
+}
+
+static int read_binary_array(const char *type_name, int64_t elem_size,
+                             void **data, int64_t *shape, int64_t dims) {
+  int64_t payload_size = read_binary_header(type_name, elem_size, shape, dims);
+
+  if (payload_size < 0) {
+    return 1;
+  }
+
+  if (input_is_mapped(input.pos) && host_is_little_endian() && payload_size > 0) {
+    // Use the mapped payload directly.
+    if ((uint64_t)payload_size > (uint64_t)(input.end - input.pos)) {
+      return 1;
+    }
+    free(*data);
+    *data = (void*)input.pos;
+    input.pos += payload_size;
+    return 0;
+  }
+
+  free(*data);
+  *data = host_alloc(payload_size);
+  if (*data == NULL) {
+    return 1;
+  }
+  if (input_read(*data, payload_size) != (size_t)payload_size) {
+    return 1;
+  }
+  if (!host_is_little_endian()) {
+    byteswap_elems(*data, elem_size, payload_size / elem_size);
+  }
+  return 0;
+}
+
+/* Input cache.
+
+   Parsing large textual inputs is slow, so the array read from an
+   input file named on the command line is also stored, in the binary
+   format, in a sidecar file next to it.  Later runs read the sidecar
+   instead of the input file, as long as the input file still has the
+   size, modification time and identity recorded in the sidecar, and
+   the array has the expected type and rank; otherwise the sidecar is
+   rebuilt.  A sidecar is a key followed by the binary array, with
+   spaces in between so that the elements are aligned in memory when
+   the sidecar is memory-mapped. */
+
+#define INPUT_CACHE_SUFFIX ".cache"
+#define INPUT_CACHE_MAGIC "FUTCACHE"
+#define INPUT_CACHE_ALIGN 64
+
+static int use_input_cache = 1;
+
+struct input_cache_key {
+  char magic[8];
+  uint64_t size, dev, ino;
+  int64_t mtime_sec, mtime_nsec;
+  char type_name[4];
+  int32_t dims;
+  char unused[8];
+};
+
+struct input_cache {
+  char *path;                   // Of the sidecar, or NULL.
+  struct input_cache_key key;
+  int looked_up;                // Only the first array is cached.
+  int store;                    // Whether to store the array being read.
+  int fd;                       // Of the sidecar being written, or -1.
+  char *tmp_path;
+  off_t header_offset;
+};
+
+static struct input_cache input_cache = { .path = NULL, .fd = -1 };
+
+static void input_cache_prepare(const char *path, int fd) {
+  struct input_cache_key *key = &input_cache.key;
+  struct stat st;
+
+  // A new input, which may have its own sidecar.
+  free(input_cache.path);
+  input_cache.path = NULL;
+  input_cache.looked_up = 0;
+  input_cache.store = 0;
+
+  if (!use_input_cache || !host_is_little_endian() ||
+      fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+
+  memset(key, 0, sizeof(*key));
+  memcpy(key->magic, INPUT_CACHE_MAGIC, sizeof(key->magic));
+  key->size = st.st_size;
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+
+  input_cache.path = malloc(strlen(path) + strlen(INPUT_CACHE_SUFFIX) + 1);
+  sprintf(input_cache.path, "%s%s", path, INPUT_CACHE_SUFFIX);
+}
+
+/* Offset of the binary header in a sidecar, chosen so that the
+   elements are aligned. */
+static off_t input_cache_header_offset(int64_t dims) {
+  return binary_array_offset(sizeof(struct input_cache_key), dims, INPUT_CACHE_ALIGN);
+}
+
+/* Called before the array is read.  Switches the input over to the
+   sidecar if it is valid for an array of the given type and rank, and
+   otherwise arranges for the array to be stored once read. */
+static void input_cache_lookup(const char *type_name, int64_t elem_size, int64_t dims) {
+  struct input_cache_key found;
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127];
+  off_t header_offset = input_cache_header_offset(dims);
+  size_t header_size = 1 + 1 + 1 + 4 + 8 * dims;
+  int64_t shape[127];
+  int64_t payload_size;
+  struct stat st;
+  int fd;
+
+  if (input_cache.path == NULL || input_cache.looked_up) {
+    return;
+  }
+  input_cache.looked_up = 1;
+  memcpy(input_cache.key.type_name, type_name, 4);
+  input_cache.key.dims = dims;
+
+  fd = open(input_cache.path, O_RDONLY);
+  if (fd >= 0) {
+    if (fstat(fd, &st) == 0 &&
+        pread(fd, &found, sizeof(found), 0) == sizeof(found) &&
+        memcmp(&found, &input_cache.key, sizeof(found)) == 0 &&
+        pread(fd, header, header_size, header_offset) == (ssize_t)header_size &&
+        header[0] == 'b' &&
+        (payload_size = decode_binary_header(header + 1, type_name, elem_size,
+                                             shape, dims)) >= 0 &&
+        st.st_size == header_offset + (off_t)header_size + payload_size &&
+        lseek(fd, header_offset, SEEK_SET) == header_offset) {
+      if (cl_debug) {
+        fprintf(stderr, "Reading cached input from %s.\n", input_cache.path);
+      }
+      input_close();
+      input_from_fd(fd);
+      return;
+    }
+    close(fd);
+  }
+
+  // Binary input is not worth caching.
+  input_cache.store = !read_is_binary();
+  if (input_cache.store && cl_debug) {
+    fprintf(stderr, "Input cache %s is missing or stale.\n", input_cache.path);
+  }
+}
+
+/* Starts storing the array being read, if it should be.  Returns
+   non-zero if not. */
+static int input_cache_begin(int64_t dims) {
+  char spaces[INPUT_CACHE_ALIGN];
+  off_t header_offset = input_cache_header_offset(dims);
+  size_t header_size = 1 + 1 + 1 + 4 + 8 * dims;
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127] = { 0 };
+  size_t n = header_offset - sizeof(struct input_cache_key);
+
+  if (!input_cache.store) {
+    return 1;
+  }
+  input_cache.store = 0;
+
+  input_cache.tmp_path = malloc(strlen(input_cache.path) + 8);
+  sprintf(input_cache.tmp_path, "%s.XXXXXX", input_cache.path);
+  input_cache.fd = mkstemp(input_cache.tmp_path);
+  if (input_cache.fd < 0) {
+    free(input_cache.tmp_path);
+    return 1;
+  }
+  input_cache.header_offset = header_offset;
+  memset(spaces, ' ', sizeof(spaces));
+
+  // The header is written properly once the shape is known.
+  if (write(input_cache.fd, &input_cache.key, sizeof(input_cache.key)) !=
+      sizeof(input_cache.key) ||
+      write(input_cache.fd, spaces, n) != (ssize_t)n ||
+      write(input_cache.fd, header, header_size) != (ssize_t)header_size) {
+    close(input_cache.fd);
+    input_cache.fd = -1;
+    unlink(input_cache.tmp_path);
+    free(input_cache.tmp_path);
+    return 1;
+  }
+  return 0;
+}
+
+static void input_cache_append(const void *data, size_t n) {
+  while (input_cache.fd >= 0 && n > 0) {
+    ssize_t written = write(input_cache.fd, data, n);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      close(input_cache.fd);
+      input_cache.fd = -1;
+      unlink(input_cache.tmp_path);
+      free(input_cache.tmp_path);
+      break;
+    }
+    data = (const char*)data + written;
+    n -= written;
+  }
+}
+
+/* Finishes storing the array, which was read successfully if ok is
+   non-zero. */
+static void input_cache_end(int ok, const int64_t *shape, int64_t dims) {
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127];
+  size_t header_size;
+
+  if (input_cache.fd < 0) {
+    return;
+  }
+  header_size = encode_binary_header(header, input_cache.key.type_name, shape, dims);
+
+  // Only a complete sidecar gets its final name.
+  ok = ok && pwrite(input_cache.fd, header, header_size,
+                    input_cache.header_offset) == (ssize_t)header_size;
+  ok = close(input_cache.fd) == 0 && ok;
+  if (ok && rename(input_cache.tmp_path, input_cache.path) == 0) {
+    if (cl_debug) {
+      fprintf(stderr, "Stored input in cache %s.\n", input_cache.path);
+    }
+  } else {
+    unlink(input_cache.tmp_path);
+  }
+  input_cache.fd = -1;
+  free(input_cache.tmp_path);
+}
+
+/* Stores a whole array, if it should be. */
+static void input_cache_store(int64_t elem_size, const void *data,
+                              const int64_t *shape, int64_t dims) {
+  int64_t n = elem_size;
+
+  if (input_cache_begin(dims) == 0) {
+    for (int64_t i = 0; i < dims; i++) {
+      n *= shape[i];
+    }
+    input_cache_append(data, n);
+    input_cache_end(1, shape, dims);
+  }
+}
+
+/* Reads an array in whichever format the input is in. */
+static int read_input_array(const char *type_name, int64_t elem_size,
+                            int (*elem_reader)(void*),
+                            void **data, int64_t *shape, int64_t dims) {
+  int ret;
+
+  input_cache_lookup(type_name, elem_size, dims);
+  if (read_is_binary()) {
+    return read_binary_array(type_name, elem_size, data, shape, dims);
+  }
+  ret = read_array(elem_size, elem_reader, data, shape, dims);
+  if (ret == 0) {
+    input_cache_store(elem_size, *data, shape, dims);
+  }
+  return ret;
+}
+
+/* Pipelined upload.
+
+   Normally an input array is read completely into host memory and then
+   copied to the device in one blocking transfer.  With a non-zero
+   upload_chunk_size the array is instead uploaded in chunks of about
+   that many bytes while it is being read.  Chunks are assembled in two
+   pinned staging buffers: once one is full, a non-blocking write of it
+   to the right offset of the device buffer is enqueued, and reading
+   continues into the other.  A staging buffer is only reused once its
+   previous write has completed.  The number of elements of textual
+   input is not known in advance, so there the device buffer is grown,
+   by copying on the device, as needed. */
+
+static int64_t upload_chunk_size = 0;
+
+struct upload_pipeline {
+  struct memblock_device *block;
+  int64_t block_size;           // Bytes allocated on the device.
+  int64_t uploaded;             // Bytes enqueued for upload.
+  int64_t chunk_size;           // Bytes per staging buffer.
+  cl_mem staging_mem[2];
+  char *staging[2];
+  cl_event events[2];           // Pending write from each staging buffer.
+  int current;                  // The staging buffer being filled.
+  int64_t n_chunks;
+  int64_t wait_time;            // Time spent waiting for writes.
+  int64_t transfer_time;        // Time spent writing, with profiling.
+};
+
+static void upload_begin(struct upload_pipeline *p, struct memblock_device *block,
+                         int64_t size, int64_t chunk_size) {
+  cl_int error;
+
+  p->block = block;
+  p->block_size = size;
+  p->uploaded = 0;
+  p->chunk_size = chunk_size;
+  p->current = 0;
+  p->n_chunks = 0;
+  p->wait_time = 0;
+  p->transfer_time = 0;
+  memblock_alloc_device(block, size);
+
+  for (int i = 0; i < 2; i++) {
+    // Memory allocated by the OpenCL runtime is pinned, which
+    // non-blocking writes need in order to be truly asynchronous.
+    p->staging_mem[i] = device_pool_create(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                           chunk_size, &error);
+    OPENCL_SUCCEED(error);
+    p->staging[i] = clEnqueueMapBuffer(fut_cl_queue, p->staging_mem[i], CL_TRUE,
+                                       CL_MAP_WRITE, 0, chunk_size,
+                                       0, NULL, NULL, &error);
+    OPENCL_SUCCEED(error);
+    p->events[i] = NULL;
+  }
+}
+
+/* Waits for the transfer with the given event, if any, and releases
+   the event.  Adds the time spent waiting to *wait_time and, when
+   profiling, the time the transfer took to *transfer_time. */
+static void transfer_wait(cl_event *event, int64_t *wait_time, int64_t *transfer_time) {
+  int64_t t_start;
+  cl_ulong start, end;
+
+  if (*event == NULL) {
+    return;
+  }
+  t_start = get_wall_time();
+  OPENCL_SUCCEED(clWaitForEvents(1, event));
+  *wait_time += get_wall_time() - t_start;
+
+  if (cl_debug &&
+      clGetEventProfilingInfo(*event, CL_PROFILING_COMMAND_START,
+                              sizeof(start), &start, NULL) == CL_SUCCESS &&
+      clGetEventProfilingInfo(*event, CL_PROFILING_COMMAND_END,
+                              sizeof(end), &end, NULL) == CL_SUCCESS) {
+    *transfer_time += (end - start) / 1000;
+  }
+  OPENCL_SUCCEED(clReleaseEvent(*event));
+  *event = NULL;
+}
+
+/* Waits for the pending write from staging buffer i, if any. */
+static void upload_wait(struct upload_pipeline *p, int i) {
+  transfer_wait(&p->events[i], &p->wait_time, &p->transfer_time);
+}
+
+/* Enqueues a write of n bytes from src to the end of the uploaded part
+   of the device buffer.  src must not change until the event has
+   completed. */
+static void upload_enqueue(struct upload_pipeline *p, const void *src, int64_t n,
+                           cl_event *event) {
+  if (p->uploaded + n > p->block_size) {
+    struct memblock_device grown;
+    int64_t size = p->block_size * 2;
+
+    while (size < p->uploaded + n) {
+      size *= 2;
+    }
+    grown.references = NULL;
+    memblock_alloc_device(&grown, size);
+    if (p->uploaded > 0) {
+      OPENCL_SUCCEED(clEnqueueCopyBuffer(fut_cl_queue, p->block->mem, grown.mem,
+                                         0, 0, p->uploaded, 0, NULL, NULL));
+    }
+    memblock_unref_device(p->block);
+    *p->block = grown;
+    p->block_size = size;
+  }
+
+  OPENCL_SUCCEED(clEnqueueWriteBuffer(fut_cl_queue, p->block->mem, CL_FALSE,
+                                      p->uploaded, n, src, 0, NULL, event));
+  // Make sure the write starts while we carry on reading.
+  OPENCL_SUCCEED(clFlush(fut_cl_queue));
+  p->uploaded += n;
+  p->n_chunks++;
+}
+
+/* Uploads the first n bytes of the current staging buffer and returns
+   the other one, once it is free. */
+static char *upload_staged(struct upload_pipeline *p, int64_t n) {
+  if (n > 0) {
+    upload_enqueue(p, p->staging[p->current], n, &p->events[p->current]);
+  }
+  p->current ^= 1;
+  upload_wait(p, p->current);
+  return p->staging[p->current];
+}
+
+static void upload_end(struct upload_pipeline *p) {
+  for (int i = 0; i < 2; i++) {
+    upload_wait(p, i);
+    OPENCL_SUCCEED(clEnqueueUnmapMemObject(fut_cl_queue, p->staging_mem[i],
+                                           p->staging[i], 0, NULL, NULL));
+    OPENCL_SUCCEED(clReleaseMemObject(p->staging_mem[i]));
+  }
+}
+
+static int upload_flush(struct array_reader *reader) {
+  struct upload_pipeline *p = (struct upload_pipeline*) reader->flush_arg;
+
+  input_cache_append(reader->elems, reader->n_elems_used * reader->elem_size);
+  reader->elems = upload_staged(p, reader->n_elems_used * reader->elem_size);
+  reader->n_elems_used = 0;
+  return 0;
+}
+
+/* Like read_input_array(), but uploads the array into a new device
+   block while reading it.  The block may be larger than the array. */
+static int read_input_array_device(const char *type_name, int64_t elem_size,
+                                   int (*elem_reader)(void*),
+                                   struct memblock_device *block,
+                                   int64_t *shape, int64_t dims) {
+  struct upload_pipeline p;
+  int64_t chunk_elems = upload_chunk_size / elem_size > 0 ?
+    upload_chunk_size / elem_size : 1;
+  int64_t chunk_size = chunk_elems * elem_size;
+  int ret = 0;
+
+  input_cache_lookup(type_name, elem_size, dims);
+  if (read_is_binary()) {
+    int64_t payload_size = read_binary_header(type_name, elem_size, shape, dims);
+
+    if (payload_size < 0) {
+      return 1;
+    }
+    upload_begin(&p, block, payload_size, chunk_size);
+
+    if (input_is_mapped(input.pos) && host_is_little_endian()) {
+      // The payload is already in memory, so upload it in one go.
+      if ((uint64_t)payload_size > (uint64_t)(input.end - input.pos)) {
+        ret = 1;
+      } else if (payload_size > 0) {
+        upload_enqueue(&p, input.pos, payload_size, &p.events[0]);
+        input.pos += payload_size;
+      }
+    } else {
+      char *buf = p.staging[p.current];
+      for (int64_t done = 0; done < payload_size; ) {
+        int64_t n = payload_size - done < chunk_size ? payload_size - done : chunk_size;
+        if (input_read(buf, n) != (size_t)n) {
+          ret = 1;
+          break;
+        }
+        if (!host_is_little_endian()) {
+          byteswap_elems(buf, elem_size, n / elem_size);
+        }
+        buf = upload_staged(&p, n);
+        done += n;
+      }
+    }
+  } else {
+    struct array_reader reader;
+
+    upload_begin(&p, block, 2 * chunk_size, chunk_size);
+    reader.shape = shape;
+    reader.n_elems_used = 0;
+    reader.elem_size = elem_size;
+    reader.n_elems_space = chunk_elems;
+    reader.elems = p.staging[p.current];
+    reader.elem_reader = elem_reader;
+    reader.flush = upload_flush;
+    reader.flush_arg = &p;
+
+    // Parsing in parallel would need the whole input at once.
+    input_cache_begin(dims);
+    ret = read_array_into(&reader, dims, 0);
+    if (ret == 0) {
+      upload_flush(&reader);
+    }
+    input_cache_end(ret == 0, shape, dims);
+  }
+
+  upload_end(&p);
+
+  if (cl_debug) {
+    int64_t overlap = p.transfer_time - p.wait_time;
+    fprintf(stderr, "Uploaded %lld bytes in %lld chunks while reading; "
+            "transfers took %lldus, of which %lldus overlapped with reading.\n",
+            (long long) p.uploaded, (long long) p.n_chunks,
+            (long long) p.transfer_time, (long long) (overlap > 0 ? overlap : 0));
+  }
+  return ret;
+}
+
+/* Mapped input.
+
+   When the number of elements is known before they are read (from the
+   header of binary input, or by counting the separators of textual
+   input first), the array can be read straight into the device buffer,
+   mapped into host memory with clEnqueueMapBuffer().  On OpenCL
+   implementations that share memory with the host, this saves both the
+   host copy of the array and the transfer to the device. */
+
+static int map_input = 0;
+
+static int mapped_buffer_full(struct array_reader *reader) {
+  (void) reader;
+  return 1;
+}
+
+static void *map_device_block(struct memblock_device *block, int64_t size) {
+  cl_int error;
+  void *p = clEnqueueMapBuffer(fut_cl_queue, block->mem, CL_TRUE, CL_MAP_WRITE,
+                               0, size, 0, NULL, NULL, &error);
+  OPENCL_SUCCEED(error);
+  return p;
+}
+
+static void unmap_device_block(struct memblock_device *block, void *p) {
+  OPENCL_SUCCEED(clEnqueueUnmapMemObject(fut_cl_queue, block->mem, p,
+                                         0, NULL, NULL));
+}
+
+/* Like read_input_array_device(), but reads straight into the device
+   block. */
+static int read_input_array_mapped(const char *type_name, int64_t elem_size,
+                                   int (*elem_reader)(void*),
+                                   struct memblock_device *block,
+                                   int64_t *shape, int64_t dims) {
+  struct parse_range all;
+  struct array_reader reader;
+  const unsigned char *start;
+  char *data = NULL;
+  int64_t size = elem_size;
+  int ret;
+
+  input_cache_lookup(type_name, elem_size, dims);
+  if (read_is_binary()) {
+    int64_t payload_size = read_binary_header(type_name, elem_size, shape, dims);
+
+    if (payload_size < 0) {
+      return 1;
+    }
+    memblock_alloc_device(block, payload_size);
+    if (payload_size == 0) {
+      return 0;
+    }
+    data = map_device_block(block, payload_size);
+    ret = input_read(data, payload_size) != (size_t)payload_size;
+    if (ret == 0 && !host_is_little_endian()) {
+      byteswap_elems(data, elem_size, payload_size / elem_size);
+    }
+    unmap_device_block(block, data);
+    return ret;
+  }
+
+  // There are at most one more elements than separators, even if the
+  // array is followed by more input.
+  input_slurp();
+  start = input.pos;
+  all.start = start;
+  all.end = input.end;
+  all.first = 1;
+  count_range(&all);
+
+  memblock_alloc_device(block, all.n_elems * elem_size);
+  reader.shape = shape;
+  reader.n_elems_used = 0;
+  reader.elem_size = elem_size;
+  reader.n_elems_space = all.n_elems;
+  reader.elems = map_device_block(block, all.n_elems * elem_size);
+  reader.elem_reader = elem_reader;
+  reader.flush = mapped_buffer_full;
+  ret = read_array_into(&reader, dims, 1);
+  if (ret == 0) {
+    input_cache_store(elem_size, reader.elems, shape, dims);
+  }
+  unmap_device_block(block, reader.elems);
+  if (ret == 0) {
+    return 0;
+  }
+
+  // Read the array again the usual way, so that the outcome, whether a
+  // syntax error or not, is the same as without mapping.
+  input.pos = start;
+  if (read_array(elem_size, elem_reader, (void**) &data, shape, dims) == 0) {
+    for (int64_t i = 0; i < dims; i++) {
+      size *= shape[i];
+    }
+    memblock_alloc_device(block, size);
+    if (size > 0) {
+      OPENCL_SUCCEED(clEnqueueWriteBuffer(fut_cl_queue, block->mem, CL_TRUE,
+                                          0, size, data, 0, NULL, NULL));
+    }
+    input_cache_store(elem_size, data, shape, dims);
+    ret = 0;
+  }
+  free(data);
+  return ret;
+}
+
+/* Out-of-core execution.
+
+   Arrays too large for device memory are scanned in chunks, each by a
+   call of futhark_main() on the device, with the last element of every
+   chunk's result added to the whole of the next as it comes back to
+   the host.  Uploads and downloads go through a second command queue,
+   so that while one chunk is being scanned, the next is uploaded and
+   the previous downloaded; each chunk has one of two device buffers,
+   and is only uploaded once the chunk before it in that buffer has
+   been scanned.  The result is left in host memory, in chunked_result,
+   from where it is output.
+
+   Chunks are sized so that a chunk's input, intermediate arrays, and
+   result, the neighbouring chunks' buffers, and the scan's per-group
+   arrays, whose size does not depend on the chunk, all fit in the
+   device memory given by --max-device-mem, or in
+   CL_DEVICE_GLOBAL_MEM_SIZE.  Only input that was read into host
+   memory can be chunked. */
+
+static int64_t max_device_mem = 0;
+static cl_command_queue transfer_queue = NULL;
+static int32_t *chunked_result = NULL;
+
+/* Returns the device memory taken by the arrays of a call of
+   futhark_main() whose size does not depend on the input, as rounded
+   by the pool.  The single-pass scan's tile status words grow with
+   the chunk and are covered by the allowance for rounding. */
+static int64_t fixed_device_bytes() {
+  int64_t groups = cl_num_groups, threads = cl_num_groups * cl_group_size;
+
+  if (single_pass_scan) {
+    return 0;
+  }
+  // The per-thread sums and their carries, and three per-group arrays.
+  return 2 * device_pool_size_class(threads * sizeof(int32_t)) +
+    3 * device_pool_size_class(groups * sizeof(int32_t));
+}
+
+/* Returns the largest number of bytes of input that is scanned at
+   once. */
+static int64_t chunk_bytes() {
+  cl_ulong global_mem_size, max_alloc_size;
+  int64_t budget, chunk;
+
+  OPENCL_SUCCEED(clGetDeviceInfo(fut_cl_device, CL_DEVICE_GLOBAL_MEM_SIZE,
+                                 sizeof(global_mem_size), &global_mem_size, NULL));
+  OPENCL_SUCCEED(clGetDeviceInfo(fut_cl_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                                 sizeof(max_alloc_size), &max_alloc_size, NULL));
+  budget = global_mem_size;
+  if (max_device_mem > 0 && max_device_mem < budget) {
+    budget = max_device_mem;
+  }
+  budget -= fixed_device_bytes();
+  // Two inputs, two scanned arrays and two results, and size class
+  // rounding on top.
+  chunk = budget / 8;
+  if (chunk > (int64_t) max_alloc_size) {
+    chunk = max_alloc_size;
+  }
+  chunk = chunk / sizeof(int32_t) * sizeof(int32_t);
+  if (chunk <= 0) {
+    panic(1, "%lld bytes of device memory cannot hold a chunk of even one element.\n",
+          (long long) budget + fixed_device_bytes());
+  }
+  return chunk;
+}
+
+/* Waits for the download of a chunk of the result, adds the carry from
+   the chunks before it, and returns the carry for the next one. */
+static uint32_t finish_chunk(cl_event *read, uint32_t *out, int64_t n,
+                             uint32_t carry, int64_t *wait_time, int64_t *transfer_time) {
+  transfer_wait(read, wait_time, transfer_time);
+  if (carry != 0) {
+    for (int64_t i = 0; i < n; i++) {
+      out[i] += carry;
+    }
+  }
+  return n > 0 ? out[n - 1] : carry;
+}
+
+/* Scans the n elements in host memory at in, chunk_size bytes at a
+   time, into chunked_result. */
+static struct tuple_int64_t_device_mem_int64_t
+futhark_main_chunked(const int32_t *in, int64_t n, int64_t chunk_size) {
+  struct tuple_int64_t_device_mem_int64_t ret;
+  int64_t chunk = chunk_size / sizeof(int32_t);
+  int64_t n_chunks = (n + chunk - 1) / chunk;
+  struct memblock_device slots[2];
+  struct tuple_int64_t_device_mem_int64_t results[2];
+  cl_event uploads[2] = {NULL, NULL};
+  cl_event scans[2] = {NULL, NULL};
+  cl_event reads[2] = {NULL, NULL};
+  int64_t wait_time = 0, transfer_time = 0;
+  uint32_t carry = 0;
+  int64_t t_start = get_wall_time();
+  cl_int error;
+
+  if (transfer_queue == NULL) {
+    transfer_queue = clCreateCommandQueue(fut_cl_context, fut_cl_device,
+                                          cl_debug ? CL_QUEUE_PROFILING_ENABLE : 0,
+                                          &error);
+    OPENCL_SUCCEED(error);
+  }
+  if (chunked_result == NULL) {
+    chunked_result = host_alloc(n * sizeof(int32_t));
+    if (chunked_result == NULL) {
+      panic(1, "Cannot allocate %lld bytes for the result.\n",
+            (long long) (n * sizeof(int32_t)));
+    }
+    host_count(n * sizeof(int32_t));
+  }
+
+  for (int i = 0; i < 2; i++) {
+    slots[i].references = NULL;
+    memblock_alloc_device(&slots[i], chunk_size);
+    results[i].elem_1.references = NULL;
+  }
+
+  for (int64_t k = 0; k < n_chunks; k++) {
+    int s = k & 1;
+
+    // Upload this chunk, unless it was uploaded ahead, and the next.
+    for (int64_t j = k == 0 ? 0 : k + 1; j <= k + 1 && j < n_chunks; j++) {
+      int64_t m = n - j * chunk < chunk ? n - j * chunk : chunk;
+      int t = j & 1;
+      cl_uint n_waits = scans[t] != NULL;
+
+      OPENCL_SUCCEED(clEnqueueWriteBuffer(transfer_queue, slots[t].mem, CL_FALSE,
+                                          0, m * sizeof(int32_t), in + j * chunk,
+                                          n_waits, n_waits ? &scans[t] : NULL,
+                                          &uploads[t]));
+      if (scans[t] != NULL) {
+        OPENCL_SUCCEED(clReleaseEvent(scans[t]));
+        scans[t] = NULL;
+      }
+    }
+    OPENCL_SUCCEED(clFlush(transfer_queue));
+
+    int64_t len = n - k * chunk < chunk ? n - k * chunk : chunk;
+
+    OPENCL_SUCCEED(clEnqueueBarrierWithWaitList(fut_cl_queue, 1, &uploads[s], NULL));
+    OPENCL_SUCCEED(clReleaseEvent(uploads[s]));
+    uploads[s] = NULL;
+    results[s] = futhark_main(len * sizeof(int32_t), slots[s], len);
+    OPENCL_SUCCEED(clEnqueueMarkerWithWaitList(fut_cl_queue, 0, NULL, &scans[s]));
+    OPENCL_SUCCEED(clFlush(fut_cl_queue));
+    OPENCL_SUCCEED(clEnqueueReadBuffer(transfer_queue, results[s].elem_1.mem, CL_FALSE,
+                                       0, len * sizeof(int32_t),
+                                       chunked_result + k * chunk,
+                                       1, &scans[s], &reads[s]));
+    OPENCL_SUCCEED(clFlush(transfer_queue));
+
+    // Meanwhile, finish the chunk before.
+    if (k > 0) {
+      carry = finish_chunk(&reads[s ^ 1], (uint32_t*) chunked_result + (k - 1) * chunk,
+                           chunk, carry, &wait_time, &transfer_time);
+      memblock_unref_device(&results[s ^ 1].elem_1);
+    }
+  }
+  if (n_chunks > 0) {
+    int64_t k = n_chunks - 1;
+
+    finish_chunk(&reads[k & 1], (uint32_t*) chunked_result + k * chunk,
+                 n - k * chunk, carry, &wait_time, &transfer_time);
+    memblock_unref_device(&results[k & 1].elem_1);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (scans[i] != NULL) {
+      OPENCL_SUCCEED(clReleaseEvent(scans[i]));
+    }
+    memblock_unref_device(&slots[i]);
+  }
+
+  if (cl_debug) {
+    fprintf(stderr, "Scanned %lld elements in %lld chunks of %lld in %lldus; "
+            "waited %lldus for downloads, which took %lldus.\n",
+            (long long) n, (long long) n_chunks, (long long) chunk,
+            (long long) (get_wall_time() - t_start),
+            (long long) wait_time, (long long) transfer_time);
+  }
+
+  ret.elem_0 = n * sizeof(int32_t);
+  ret.elem_1.references = NULL;
+  ret.elem_1.mem = NULL;
+  ret.elem_1.size = 0;
+  ret.elem_2 = n;
+  return ret;
+}
+
+/* Shared-memory handoff.
+
+   With --shm-input, the input array is taken from a POSIX shared
+   memory object instead of a file, and with --shm-output the result is
+   written to one instead of being printed.  Such an object starts with
+   a struct shm_header, followed by the array in either data format;
+   the binary format avoids parsing altogether, and its elements are
+   then used in place.  The state word of the header is used for
+   signalling between the processes, through a futex on Linux:
+
+   - The producer creates and sizes the input object, fills it in, and
+     sets the state to SHM_READY.  The program maps the object at its
+     size once it is ready, so it may be created empty and sized
+     later, or grown when it is reused.  Once the array is on the device, or
+     once every run is done if it is scanned out of core, the program
+     sets it to SHM_DONE, after which the producer may reuse the
+     object.
+
+   - The program creates the output object, or, if it exists, sets its
+     state to SHM_EMPTY and only then resizes it.  It writes the result
+     from the device straight into it and sets the state to SHM_READY.
+     A consumer that reuses the object across runs must see SHM_EMPTY
+     before it waits for SHM_READY, or it may take the previous run's
+     state for this one's.  It should map the object only once the
+     state is SHM_READY, since the size may have changed. */
+
+#define SHM_MAGIC "FUTSHM01"
+#define SHM_EMPTY 0
+#define SHM_READY 1
+#define SHM_DONE 2
+#define SHM_ALIGN 64
+
+struct shm_header {
+  char magic[8];
+  uint32_t state;
+  uint32_t unused;
+  uint64_t size;                // Bytes of data following the header.
+  char pad[40];
+};
+
+static const char *shm_input_name = NULL;
+static const char *shm_output_name = NULL;
+static struct shm_header *shm_input = NULL;
+
+static void shm_wait(uint32_t *state, uint32_t value) {
+  uint32_t seen;
+
+  while ((seen = __atomic_load_n(state, __ATOMIC_ACQUIRE)) != value) {
+#ifdef __linux__
+    // Time out now and then, for producers that do not wake us.
+    struct timespec timeout = { 0, 10 * 1000 * 1000 };
+    syscall(SYS_futex, state, FUTEX_WAIT, seen, &timeout, NULL, 0);
+#else
+    usleep(1000);
+#endif
+  }
+}
+
+static void shm_signal(uint32_t *state, uint32_t value) {
+  __atomic_store_n(state, value, __ATOMIC_RELEASE);
+#ifdef __linux__
+  syscall(SYS_futex, state, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
 
-  ret = read_array_elems(&reader, dims);
+/* Waits for the input object to become ready and reads from it. */
+static void open_shm_input(const char *name) {
+  struct stat st;
+  struct shm_header *h;
+  int fd = shm_open(name, O_RDWR, 0);
 
-  *data = reader.elems;
+  if (fd < 0) {
+    panic(1, "Cannot open shared memory object %s: %s\n", name, strerror(errno));
+  }
+  // The producer may not have sized the object yet, and may resize it
+  // before it is ready, so only the header is mapped until then.
+  while (1) {
+    if (fstat(fd, &st) != 0) {
+      panic(1, "Cannot stat shared memory object %s: %s\n", name, strerror(errno));
+    }
+    if (st.st_size >= (off_t)sizeof(struct shm_header)) {
+      break;
+    }
+    usleep(1000);
+  }
+  h = mmap(NULL, sizeof(struct shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) {
+    panic(1, "Cannot map shared memory object %s: %s\n", name, strerror(errno));
+  }
+  shm_wait(&h->state, SHM_READY);
+  munmap(h, sizeof(struct shm_header));
 
-  return ret;
+  if (fstat(fd, &st) != 0) {
+    panic(1, "Cannot stat shared memory object %s: %s\n", name, strerror(errno));
+  }
+  h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) {
+    panic(1, "Cannot map shared memory object %s: %s\n", name, strerror(errno));
+  }
+  if (memcmp(h->magic, SHM_MAGIC, sizeof(h->magic)) != 0 ||
+      h->size > st.st_size - sizeof(struct shm_header)) {
+    panic(1, "Shared memory object %s has an invalid header.\n", name);
+  }
+
+  input_map = (const char*)h;
+  input_map_size = st.st_size;
+  input.pos = (const unsigned char*)(h + 1);
+  input.end = input.pos + h->size;
+  input.buf = NULL;
+  input.fd = fd;
+  input.eof = 1;
+  shm_input = h;
+  input_start_decompression();
 }
 
-static int read_int8(void* dest) {
-  skipspaces();
-  if (scanf("%hhi", (int8_t*)dest) == 1) {
-    scanf("i8");
-    return next_is_not_constituent() ? 0 : 1;
+/* Tells the producer that the input object is no longer needed. */
+static void release_shm_input() {
+  if (shm_input != NULL) {
+    shm_signal(&shm_input->state, SHM_DONE);
+  }
+}
+
+/* Reads the array in the device buffer mem, or in chunked_result if
+   it was scanned out of core, into the output object, in the binary
+   format, and signals that it is ready. */
+static void store_shm_output(const char *name, const char *type_name, int64_t elem_size,
+                             cl_mem mem, const int64_t *shape, int64_t dims) {
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127];
+  size_t header_size = encode_binary_header(header, type_name, shape, dims);
+  off_t offset = binary_array_offset(sizeof(struct shm_header), dims, SHM_ALIGN);
+  int64_t payload_size = elem_size;
+  struct shm_header *h;
+  struct stat st;
+  char *payload;
+  size_t total;
+  int fd;
+
+  for (int64_t i = 0; i < dims; i++) {
+    payload_size *= shape[i];
+  }
+  total = offset + header_size + payload_size;
+
+  fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    panic(1, "Cannot open shared memory object %s: %s\n", name, strerror(errno));
+  }
+  // An object left from an earlier run may still read SHM_READY, so it
+  // is marked empty before its size changes under a waiting consumer.
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct shm_header)) {
+    h = mmap(NULL, sizeof(struct shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+      panic(1, "Cannot map shared memory object %s: %s\n", name, strerror(errno));
+    }
+    shm_signal(&h->state, SHM_EMPTY);
+    munmap(h, sizeof(struct shm_header));
+  }
+  if (ftruncate(fd, total) != 0) {
+    panic(1, "Cannot resize shared memory object %s: %s\n", name, strerror(errno));
+  }
+  h = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) {
+    panic(1, "Cannot map shared memory object %s: %s\n", name, strerror(errno));
+  }
+
+  __atomic_store_n(&h->state, SHM_EMPTY, __ATOMIC_RELAXED);
+  memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+  h->size = total - sizeof(struct shm_header);
+  memset(h + 1, ' ', offset - sizeof(struct shm_header));
+  memcpy((char*)h + offset, header, header_size);
+  payload = (char*)h + offset + header_size;
+  if (chunked_result != NULL) {
+    memcpy(payload, chunked_result, payload_size);
+  } else if (payload_size > 0) {
+    OPENCL_SUCCEED(clEnqueueReadBuffer(fut_cl_queue, mem, CL_TRUE, 0, payload_size,
+                                       payload, 0, NULL, NULL));
+  }
+  if (!host_is_little_endian()) {
+    byteswap_elems(payload, elem_size, payload_size / elem_size);
+  }
+  shm_signal(&h->state, SHM_READY);
+
+  munmap(h, total);
+  close(fd);
+}
+
+/* Buffered output.
+
+   Results are formatted into a large buffer, which is written out with
+   a single write() whenever it fills up, instead of being printed
+   element by element through stdio.  Integers are formatted two digits
+   at a time.  The output is the same as printf() would produce, except
+   that --no-type-suffix leaves out the type suffixes of the elements.
+   With --binary-output, results are written in the binary data format
+   instead, and with --output-file, to a file instead of stdout.
+   Either way they are written as they come back from the device,
+   without a host copy of the whole array. */
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+// Longest single item formatted into the buffer.
+#define OUTPUT_MAX_ITEM 64
+
+static int print_type_suffixes = 1;
+static int binary_output = 0;
+static int output_fd = STDOUT_FILENO;
+
+static char output_buf[OUTPUT_BUFFER_SIZE];
+static size_t output_used = 0;
+
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static void output_write(const void *p, size_t n) {
+  size_t done = 0;
+
+  while (done < n) {
+    ssize_t written = write(output_fd, (const char*)p + done, n - done);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      panic(1, "Cannot write output: %s\n", strerror(errno));
+    }
+    done += written;
+  }
+}
+
+static void output_flush() {
+  fflush(stdout);
+  output_write(output_buf, output_used);
+  output_used = 0;
+}
+
+/* Returns room for at least OUTPUT_MAX_ITEM bytes. */
+static inline char *output_reserve() {
+  if (output_used > OUTPUT_BUFFER_SIZE - OUTPUT_MAX_ITEM) {
+    output_flush();
+  }
+  return output_buf + output_used;
+}
+
+static inline void output_str(const char *s) {
+  size_t n = strlen(s);
+  char *p = output_reserve();
+
+  assert(n <= OUTPUT_MAX_ITEM);
+  memcpy(p, s, n);
+  output_used += n;
+}
+
+static inline int decimal_length(uint32_t x) {
+  static const uint32_t powers_of_10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+  };
+  // An estimate of log10 from log2, corrected by one comparison.  The
+  // or keeps zero out of __builtin_clz() and never changes the length.
+  uint32_t v = x | 1;
+  int t = (32 - __builtin_clz(v)) * 1233 >> 12;
+
+  return t - (v < powers_of_10[t]) + 1;
+}
+
+/* Formats x at p, returning the end. */
+static inline char *format_uint32(char *p, uint32_t x) {
+  char *end = p + decimal_length(x);
+
+  p = end;
+  while (x >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + 2 * (x % 100), 2);
+    x /= 100;
+  }
+  if (x >= 10) {
+    memcpy(p - 2, digit_pairs + 2 * x, 2);
   } else {
-    return 1;
+    p[-1] = '0' + x;
   }
+  return end;
 }
 
-static int read_int16(void* dest) {
-  skipspaces();
-  if (scanf("%hi", (int16_t*)dest) == 1) {
-    scanf("i16");
-    return next_is_not_constituent() ? 0 : 1;
+static inline void output_int32(int32_t x) {
+  char *p = output_reserve(), *end;
+
+  if (x < 0) {
+    *p++ = '-';
+    end = format_uint32(p, 0u - (uint32_t)x);
   } else {
-    return 1;
+    end = format_uint32(p, x);
   }
+  output_used = end - output_buf;
 }
 
-static int read_int32(void* dest) {
-  skipspaces();
-  if (scanf("%i", (int32_t*)dest) == 1) {
-    scanf("i32");
-    return next_is_not_constituent() ? 0 : 1;
+/* Writes n bytes, bypassing the buffer if they are many. */
+static void output_bytes(const void *p, size_t n) {
+  if (n > OUTPUT_BUFFER_SIZE - output_used) {
+    output_flush();
+  }
+  if (n >= OUTPUT_BUFFER_SIZE / 2) {
+    output_write(p, n);
   } else {
-    return 1;
+    memcpy(output_buf + output_used, p, n);
+    output_used += n;
   }
 }
 
-static int read_int64(void* dest) {
-  skipspaces();
-  if (scanf("%Li", (int64_t*)dest) == 1) {
-    scanf("i64");
-    return next_is_not_constituent() ? 0 : 1;
+/* Writes the header of an array in the binary format. */
+static void output_binary_header(const char *type_name, const int64_t *shape, int64_t dims) {
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127];
+
+  output_bytes(header, encode_binary_header(header, type_name, shape, dims));
+}
+
+/* Writes n elements of an array in the binary format. */
+static void output_binary_elems(const void *elems, int64_t elem_size, int64_t n, int last) {
+  (void) last;
+  if (host_is_little_endian()) {
+    output_bytes(elems, n * elem_size);
   } else {
-    return 1;
+    for (int64_t i = 0; i < n; i++) {
+      char *p = output_reserve();
+      memcpy(p, (const char*)elems + i * elem_size, elem_size);
+      byteswap_elems(p, elem_size, 1);
+      output_used += elem_size;
+    }
   }
 }
 
-static int read_char(void* dest) {
-  skipspaces();
-  if (scanf("%c", (char*)dest) == 1) {
+/* Writes n elements of an array in the textual syntax, with a
+   separator after each unless it is the last of the array. */
+static void output_int32_elems(const void *elems, int64_t elem_size, int64_t n, int last) {
+  const char *suffix = print_type_suffixes ? "i32" : "";
+
+  (void) elem_size;
+  for (int64_t i = 0; i < n; i++) {
+    output_int32(((const int32_t*)elems)[i]);
+    output_str(suffix);
+    if (!last || i != n - 1) {
+      output_str(", ");
+    }
+  }
+}
+
+/* Pipelined download.
+
+   The result is read back from the device in chunks of about
+   download_chunk_size bytes, through two pinned staging buffers, so
+   that one chunk is formatted and written while the next is being
+   transferred.  With a chunk size of zero, or a result that fits in a
+   single chunk, the device buffer is mapped and written from directly
+   instead.  The chunk size defaults to DEFAULT_DOWNLOAD_CHUNK_SIZE, or
+   to zero with zero-copy buffers. */
+
+#define DEFAULT_DOWNLOAD_CHUNK_SIZE (1 << 20)
+
+static int64_t download_chunk_size = -1;        // Negative means the default.
+
+struct download_pipeline {
+  cl_mem mem;
+  int64_t size;
+  int64_t enqueued;             // Bytes enqueued for download.
+  int64_t chunk_size;
+  cl_mem staging_mem[2];
+  char *staging[2];
+  cl_event events[2];           // Pending read into each staging buffer.
+  int64_t n_chunks;
+  int64_t wait_time;
+  int64_t transfer_time;
+};
+
+/* Maps the first size bytes of a result buffer for reading.  Returns
+   NULL if there are none. */
+static void *map_output(cl_mem mem, int64_t size) {
+  cl_int error;
+  void *p;
+
+  if (size == 0) {
+    return NULL;
+  }
+  p = clEnqueueMapBuffer(fut_cl_queue, mem, CL_TRUE, CL_MAP_READ, 0, size,
+                         0, NULL, NULL, &error);
+  OPENCL_SUCCEED(error);
+  return p;
+}
+
+static void unmap_output(cl_mem mem, void *p) {
+  if (p != NULL) {
+    OPENCL_SUCCEED(clEnqueueUnmapMemObject(fut_cl_queue, mem, p, 0, NULL, NULL));
+    OPENCL_SUCCEED(clFinish(fut_cl_queue));
+  }
+}
+
+/* Enqueues a read of the next chunk into staging buffer i. */
+static void download_enqueue(struct download_pipeline *p, int i) {
+  int64_t n = p->size - p->enqueued < p->chunk_size ?
+    p->size - p->enqueued : p->chunk_size;
+
+  if (n <= 0) {
+    return;
+  }
+  OPENCL_SUCCEED(clEnqueueReadBuffer(fut_cl_queue, p->mem, CL_FALSE, p->enqueued, n,
+                                     p->staging[i], 0, NULL, &p->events[i]));
+  // Make sure the read starts while we carry on writing.
+  OPENCL_SUCCEED(clFlush(fut_cl_queue));
+  p->enqueued += n;
+  p->n_chunks++;
+}
+
+/* Passes the first size bytes of the device buffer mem to consume, in
+   consecutive chunks of whole elements, the last of them with last
+   set.  A result scanned out of core is passed on from chunked_result
+   directly. */
+static void download_array(cl_mem mem, int64_t size, int64_t elem_size,
+                           void (*consume)(const void*, int64_t, int64_t, int)) {
+  struct download_pipeline p;
+  int64_t t_start = get_wall_time();
+  cl_int error;
+
+  p.mem = mem;
+  p.size = size;
+  p.enqueued = 0;
+  p.chunk_size = download_chunk_size / elem_size * elem_size;
+  p.n_chunks = 0;
+  p.wait_time = 0;
+  p.transfer_time = 0;
+
+  if (chunked_result != NULL) {
+    consume(chunked_result, elem_size, size / elem_size, 1);
+    return;
+  }
+  if (p.chunk_size == 0 || p.chunk_size >= size) {
+    void *elems = map_output(mem, size);
+    consume(elems, elem_size, size / elem_size, 1);
+    unmap_output(mem, elems);
+    return;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    // Pinned, so that the reads are truly asynchronous.
+    p.staging_mem[i] = device_pool_create(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                          p.chunk_size, &error);
+    OPENCL_SUCCEED(error);
+    p.staging[i] = clEnqueueMapBuffer(fut_cl_queue, p.staging_mem[i], CL_TRUE,
+                                      CL_MAP_READ, 0, p.chunk_size,
+                                      0, NULL, NULL, &error);
+    OPENCL_SUCCEED(error);
+    p.events[i] = NULL;
+    download_enqueue(&p, i);
+  }
+
+  for (int64_t done = 0, i = 0; done < size; i ^= 1) {
+    int64_t n = size - done < p.chunk_size ? size - done : p.chunk_size;
+
+    transfer_wait(&p.events[i], &p.wait_time, &p.transfer_time);
+    consume(p.staging[i], elem_size, n / elem_size, done + n == size);
+    done += n;
+    download_enqueue(&p, i);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    OPENCL_SUCCEED(clEnqueueUnmapMemObject(fut_cl_queue, p.staging_mem[i],
+                                           p.staging[i], 0, NULL, NULL));
+    OPENCL_SUCCEED(clReleaseMemObject(p.staging_mem[i]));
+  }
+
+  if (cl_debug) {
+    int64_t overlap = p.transfer_time - p.wait_time;
+    fprintf(stderr, "Downloaded %lld bytes in %lld chunks in %lldus while writing output; "
+            "transfers took %lldus, of which %lldus overlapped with writing.\n",
+            (long long) size, (long long) p.n_chunks,
+            (long long) (get_wall_time() - t_start), (long long) p.transfer_time,
+            (long long) (overlap > 0 ? overlap : 0));
+  }
+}
+
+/* Zero-copy buffers.
+
+   On CPU devices, and on GPUs that share memory with the host, every
+   byte written to or read from a device buffer is copied once more
+   than necessary, since the buffer is in host memory anyway.  When
+   post_opencl_setup() sees such a device, the device buffers are
+   allocated with CL_MEM_ALLOC_HOST_PTR, so that the runtime places them
+   where the host can reach them, the input is read straight into the
+   mapped input buffer as with --map-input (unless --upload-chunk-size
+   is given), and the result is output from the mapped result buffer
+   (unless --download-chunk-size is given).  Mapping such a buffer
+   copies nothing.  --zero-copy and --no-zero-copy override the choice
+   of the device. */
+
+static int zero_copy = -1;      // Negative means decided by the device.
+
+static int device_has_unified_memory(cl_device_id device) {
+  cl_bool unified = CL_FALSE;
+
+  // Deprecated in OpenCL 2.0, so a failure just means no.
+  if (clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                      sizeof(unified), &unified, NULL) != CL_SUCCESS) {
     return 0;
-  } else {
-    return 1;
   }
+  return unified == CL_TRUE;
 }
 
-static int read_double(void* dest) {
-  skipspaces();
-  if (scanf("%lf", (double*)dest) == 1) {
-    scanf("f64");
-    return next_is_not_constituent() ? 0 : 1;
-  } else {
-    return 1;
+static void setup_zero_copy(struct opencl_device_option *option) {
+  if (zero_copy < 0) {
+    zero_copy = option->device_type == CL_DEVICE_TYPE_CPU ||
+      device_has_unified_memory(option->device);
+  }
+  if (download_chunk_size < 0) {
+    download_chunk_size = zero_copy ? 0 : DEFAULT_DOWNLOAD_CHUNK_SIZE;
+  }
+  if (!zero_copy) {
+    return;
+  }
+  device_pool_flags = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+  if (upload_chunk_size == 0) {
+    map_input = 1;
+  }
+  if (cl_debug) {
+    fprintf(stderr, "Using zero-copy device buffers.\n");
   }
 }
 
-static int read_float(void* dest) {
-  skipspaces();
-  if (scanf("%f", (float*)dest) == 1) {
-    scanf("f32");
-    return next_is_not_constituent() ? 0 : 1;
+/* Result verification.
+
+   With --expected, the result is compared against the array in the
+   given file, in either data format, instead of being written out.
+   The comparison is done chunk by chunk as the result is downloaded,
+   with memcmp() over blocks and on as many threads as parsing uses.
+   The first mismatch is reported, and the program then fails. */
+
+#define VERIFY_BLOCK 4096
+#define VERIFY_MIN_BYTES_PER_THREAD (4 << 20)
+
+static const char *expected_file = NULL;
+
+struct verification {
+  void *expected;
+  int64_t shape[1];
+  int64_t n_checked;            // Elements compared so far.
+  int64_t mismatch;             // Index of the first mismatch, or -1.
+  char got[8];                  // The result element there.
+};
+
+static struct verification verification;
+
+/* Reads the expected array.  Must be done before the input is needed
+   again, since it reuses it. */
+static void read_expected(const char *path, const char *type_name, int64_t elem_size,
+                          int (*elem_reader)(void*), int64_t dims) {
+  assert(dims <= 1);
+  input_close();
+  open_input(path);
+  verification.expected = NULL;
+  verification.n_checked = 0;
+  verification.mismatch = -1;
+  if (read_input_array(type_name, elem_size, elem_reader,
+                       &verification.expected, verification.shape, dims) != 0) {
+    panic(1, "Syntax error when reading expected output from %s.\n", path);
+  }
+}
+
+struct compare_range {
+  const char *a;
+  const char *b;
+  int64_t n;
+  int64_t diff;                 // Offset of the first difference, or -1.
+};
+
+static void *compare_range(void *arg) {
+  struct compare_range *r = arg;
+
+  r->diff = -1;
+  for (int64_t i = 0; i < r->n; i += VERIFY_BLOCK) {
+    int64_t m = r->n - i < VERIFY_BLOCK ? r->n - i : VERIFY_BLOCK;
+    if (memcmp(r->a + i, r->b + i, m) != 0) {
+      for (r->diff = i; r->a[r->diff] == r->b[r->diff]; r->diff++) {
+      }
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the offset of the first byte in which the n bytes at a and b
+   differ, or -1. */
+static int64_t first_difference(const char *a, const char *b, int64_t n) {
+  struct compare_range ranges[PARSE_MAX_THREADS];
+  pthread_t threads[PARSE_MAX_THREADS];
+  int64_t n_threads = n / VERIFY_MIN_BYTES_PER_THREAD;
+
+  if (n_threads > num_parse_threads) {
+    n_threads = num_parse_threads;
+  }
+  if (n_threads > PARSE_MAX_THREADS) {
+    n_threads = PARSE_MAX_THREADS;
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+
+  for (int64_t i = 0; i < n_threads; i++) {
+    int64_t start = n * i / n_threads, end = n * (i + 1) / n_threads;
+    ranges[i].a = a + start;
+    ranges[i].b = b + start;
+    ranges[i].n = end - start;
+  }
+  if (n_threads == 1) {
+    compare_range(&ranges[0]);
   } else {
-    return 1;
+    for (int64_t i = 0; i < n_threads; i++) {
+      if (pthread_create(&threads[i], NULL, compare_range, &ranges[i]) != 0) {
+        panic(1, "Cannot create verification thread: %s\n", strerror(errno));
+      }
+    }
+    for (int64_t i = 0; i < n_threads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  for (int64_t i = 0; i < n_threads; i++) {
+    if (ranges[i].diff >= 0) {
+      return ranges[i].a - a + ranges[i].diff;
+    }
   }
+  return -1;
 }
 
-static int read_bool(void* dest) {
-  /* This is a monstrous hack.  Maybe we should get a proper lexer in here. */
-  char b[4];
-  skipspaces();
-  if (scanf("%4c", b) == 1) {
-    if (strncmp(b, "True", 4) == 0) {
-      *(int*)dest = 1;
-      return 0;
-    } else if (strncmp(b, "Fals", 4) == 0 && getchar() == 'e') {
-      *(int*)dest = 0;
-      return 0;
-    } else {
-      return 1;
+/* Fails unless the result has the expected shape. */
+static void verify_shape(const int64_t *shape, int64_t dims) {
+  for (int64_t i = 0; i < dims; i++) {
+    if (shape[i] != verification.shape[i]) {
+      panic(1, "Result has %lld elements in dimension %lld, but %lld were expected.\n",
+            (long long) shape[i], (long long) i, (long long) verification.shape[i]);
+    }
+  }
+}
+
+/* Compares the next n elements of the result against the expected
+   array. */
+static void verify_elems(const void *elems, int64_t elem_size, int64_t n, int last) {
+  (void) last;
+  if (verification.mismatch < 0) {
+    int64_t diff = first_difference(elems,
+                                    (const char*)verification.expected +
+                                    verification.n_checked * elem_size,
+                                    n * elem_size);
+    if (diff >= 0) {
+      verification.mismatch = verification.n_checked + diff / elem_size;
+      memcpy(verification.got, (const char*)elems + diff / elem_size * elem_size,
+             elem_size);
     }
+  }
+  verification.n_checked += n;
+}
+
+/* Fails if a mismatch was found, reporting the first one. */
+static void verify_end_int32(const char *path) {
+  if (verification.mismatch >= 0) {
+    int32_t got;
+    memcpy(&got, verification.got, sizeof(got));
+    panic(1, "Result differs from %s at index %lld: got %di32, expected %di32.\n",
+          path, (long long) verification.mismatch, got,
+          ((const int32_t*)verification.expected)[verification.mismatch]);
+  }
+  if (cl_debug) {
+    fprintf(stderr, "Result matches %s.\n", path);
+  }
+}
+
+/* Result digest.
+
+   With --digest, a CRC-32 of the result in the binary data format is
+   written instead of the result itself, as eight hexadecimal digits.
+   create_input.py records the same digest for each dataset, so results
+   can be checked without storing or comparing whole outputs. */
+
+static int digest_output = 0;
+static uLong digest_crc;
+
+static void digest_bytes(const void *p, int64_t n) {
+  // crc32() takes at most an unsigned int at a time.
+  for (int64_t i = 0; i < n; i += 1 << 30) {
+    uInt m = n - i < (1 << 30) ? n - i : (1 << 30);
+    digest_crc = crc32(digest_crc, (const Bytef*)p + i, m);
+  }
+}
+
+static void digest_header(const char *type_name, const int64_t *shape, int64_t dims) {
+  unsigned char header[1 + 1 + 1 + 4 + 8 * 127];
+
+  digest_crc = crc32(0, Z_NULL, 0);
+  digest_bytes(header, encode_binary_header(header, type_name, shape, dims));
+}
+
+/* Adds n elements to the digest, in little-endian order. */
+static void digest_elems(const void *elems, int64_t elem_size, int64_t n, int last) {
+  (void) last;
+  if (host_is_little_endian()) {
+    digest_bytes(elems, n * elem_size);
   } else {
-    return 1;
+    for (int64_t i = 0; i < n; i++) {
+      char e[8];
+      memcpy(e, (const char*)elems + i * elem_size, elem_size);
+      byteswap_elems(e, elem_size, 1);
+      digest_bytes(e, elem_size);
+    }
   }
 }
 
+static void output_digest() {
+  char line[32];
+
+  snprintf(line, sizeof(line), "%08lx\n", (unsigned long) digest_crc);
+  output_str(line);
+}
+
 static FILE *runtime_file;
 static int perform_warmup = 0;
 static int num_runs = 1;
@@ -2751,7 +6013,51 @@ int parse_options(int argc, char *const argv[])
                                                                  required_argument,
                                                                  NULL, 6},
                                            {"num-groups", required_argument,
-                                            NULL, 7}, {0, 0, 0, 0}};
+                                            NULL, 7}, {"parse-threads",
+                                                       required_argument, NULL,
+                                                       8}, {"upload-chunk-size",
+                                                            required_argument,
+                                                            NULL, 9},
+                                           {"map-input", no_argument, NULL, 10},
+                                           {"no-input-cache", no_argument, NULL,
+                                            11}, {"shm-input", required_argument,
+                                                  NULL, 12}, {"shm-output",
+                                                              required_argument,
+                                                              NULL, 13},
+                                           {"no-type-suffix", no_argument, NULL,
+                                            14}, {"binary-output", no_argument,
+                                                  NULL, 15}, {"output-file",
+                                                              required_argument,
+                                                              NULL, 16},
+                                           {"download-chunk-size",
+                                            required_argument, NULL, 17},
+                                           {"expected", required_argument, NULL,
+                                            18}, {"digest", no_argument, NULL,
+                                                  19}, {"device-pool-limit",
+                                                        required_argument, NULL,
+                                                        20},
+                                           {"no-memory-plan", no_argument, NULL,
+                                            21}, {"index64", no_argument, NULL,
+                                                  22}, {"max-device-mem",
+                                                        required_argument, NULL,
+                                                        23}, {"zero-copy",
+                                                              no_argument, NULL,
+                                                              24},
+                                           {"no-zero-copy", no_argument, NULL,
+                                            25}, {"huge-pages", no_argument,
+                                                  NULL, 26}, {"numa-interleave",
+                                                              no_argument, NULL,
+                                                              27},
+                                           {"numa-node", required_argument,
+                                            NULL, 28}, {"pin-cpu",
+                                                        required_argument, NULL,
+                                                        29}, {"memory-report",
+                                                              no_argument, NULL,
+                                                              30},
+                                           {"single-pass-scan", no_argument,
+                                            NULL, 31}, {"multi-pass-scan",
+                                                        no_argument, NULL, 32},
+                                           {0, 0, 0, 0}};
     
     while ((ch = getopt_long(argc, argv, ":t:r:p:d:s", long_options, NULL)) !=
            -1) {
@@ -2776,6 +6082,83 @@ int parse_options(int argc, char *const argv[])
             cl_group_size = atoi(optarg);
         if (ch == 7)
             cl_num_groups = atoi(optarg);
+        if (ch == 8) {
+            num_parse_threads = atoi(optarg);
+            if (num_parse_threads == 0)
+                num_parse_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_parse_threads <= 0)
+                panic(1, "Need a positive number of parse threads, not %s",
+                      optarg);
+        }
+        if (ch == 9) {
+            upload_chunk_size = atoll(optarg);
+            if (upload_chunk_size < 0)
+                panic(1, "Need a non-negative upload chunk size, not %s",
+                      optarg);
+        }
+        if (ch == 10)
+            map_input = 1;
+        if (ch == 11)
+            use_input_cache = 0;
+        if (ch == 12)
+            shm_input_name = optarg;
+        if (ch == 13)
+            shm_output_name = optarg;
+        if (ch == 14)
+            print_type_suffixes = 0;
+        if (ch == 15)
+            binary_output = 1;
+        if (ch == 16) {
+            output_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (output_fd < 0)
+                panic(1, "Cannot open %s: %s", optarg, strerror(errno));
+        }
+        if (ch == 17) {
+            download_chunk_size = atoll(optarg);
+            if (download_chunk_size < 0)
+                panic(1, "Need a non-negative download chunk size, not %s",
+                      optarg);
+        }
+        if (ch == 18)
+            expected_file = optarg;
+        if (ch == 19)
+            digest_output = 1;
+        if (ch == 20)
+            device_pool_limit = atoll(optarg);
+        if (ch == 21)
+            memory_plan = 0;
+        if (ch == 22)
+            cl_index64 = 1;
+        if (ch == 23) {
+            max_device_mem = atoll(optarg);
+            if (max_device_mem <= 0)
+                panic(1, "Need a positive amount of device memory, not %s",
+                      optarg);
+        }
+        if (ch == 24)
+            zero_copy = 1;
+        if (ch == 25)
+            zero_copy = 0;
+        if (ch == 26)
+            huge_pages = 1;
+        if (ch == 27)
+            numa_interleave = 1;
+        if (ch == 28) {
+            numa_node = atoi(optarg);
+            if (numa_node < 0 || numa_node >= HOST_MAX_NODES)
+                panic(1, "Need a NUMA node number, not %s", optarg);
+        }
+        if (ch == 29) {
+            pin_cpu = atoi(optarg);
+            if (pin_cpu < 0 || pin_cpu >= HOST_MAX_CPUS)
+                panic(1, "Need a CPU number, not %s", optarg);
+        }
+        if (ch == 30)
+            memory_report = 1;
+        if (ch == 31)
+            single_pass_scan = 1;
+        if (ch == 32)
+            single_pass_scan = 0;
         if (ch == ':')
             panic(-1, "Missing argument for option %s", argv[optind - 1]);
         if (ch == '?')
@@ -2794,47 +6177,107 @@ int main(int argc, char **argv)
     
     argc -= parsed_options;
     argv += parsed_options;
+    bind_host_threads();
+    if (shm_input_name != NULL)
+        open_shm_input(shm_input_name);
+    else
+        open_input(argc > 0 ? argv[0] : NULL);
     setup_opencl_and_load_kernels();
     
-    int32_t a_mem_size_135;
+    int64_t a_mem_size_135;
     struct memblock a_mem_136;
     
     a_mem_136.references = NULL;
     memblock_alloc(&a_mem_136, 0);
     
-    int32_t size_37;
-    struct tuple_int32_t_device_mem_int32_t main_ret_259;
+    int64_t size_37;
+    struct tuple_int64_t_device_mem_int64_t main_ret_259;
+    struct memblock_device a_mem_device_260;
     
+    a_mem_device_260.references = NULL;
     {
         int64_t shape[1];
         
-        if (read_array(sizeof(int32_t), read_int32, (void **) &a_mem_136.mem,
-                       shape, 1) != 0)
+        t_start = get_wall_time();
+        if (map_input) {
+            if (read_input_array_mapped(" i32", sizeof(int32_t), read_int32,
+                                        &a_mem_device_260, shape, 1) != 0)
+                panic(1, "Syntax error when reading %s.\n", "[i32]");
+        } else if (upload_chunk_size > 0) {
+            if (read_input_array_device(" i32", sizeof(int32_t), read_int32,
+                                        &a_mem_device_260, shape, 1) != 0)
+                panic(1, "Syntax error when reading %s.\n", "[i32]");
+        } else if (read_input_array(" i32", sizeof(int32_t), read_int32,
+                                    (void **) &a_mem_136.mem, shape, 1) != 0)
             panic(1, "Syntax error when reading %s.\n", "[i32]");
+        t_end = get_wall_time();
+        if (cl_debug)
+            fprintf(stderr,
+                    "Read %ld elements in %ldus with %d parse threads.\n",
+                    (long) shape[0], (long) (t_end - t_start),
+                    num_parse_threads);
         size_37 = shape[0];
         a_mem_size_135 = sizeof(int32_t) * shape[0];
+        if (input_is_mapped(a_mem_136.mem)) {
+            /* The block borrows the input mapping and must not be freed. */
+            refcount_release(a_mem_136.references);
+            a_mem_136.references = NULL;
+            host_count(-a_mem_136.size);
+        } else if (!map_input && upload_chunk_size == 0) {
+            /* The reader has grown the block. */
+            host_count(a_mem_size_135 - a_mem_136.size);
+            a_mem_136.size = a_mem_size_135;
+        }
     }
+    pin_host_thread();
     
-    struct memblock_device a_mem_device_260;
-    
-    a_mem_device_260.references = NULL;
-    memblock_alloc_device(&a_mem_device_260, a_mem_size_135);
-    if (a_mem_size_135 > 0)
-        OPENCL_SUCCEED(clEnqueueWriteBuffer(fut_cl_queue, a_mem_device_260.mem,
-                                            CL_TRUE, 0, a_mem_size_135,
-                                            a_mem_136.mem + 0, 0, NULL, NULL));
+    int64_t chunk_size_261 = chunk_bytes();
+    int chunked_262 = !map_input && upload_chunk_size == 0 && a_mem_size_135 >
+        chunk_size_261;
+    int64_t scanned_size_263 = chunked_262 ? chunk_size_261 /
+            (int64_t) sizeof(int32_t) : size_37;
     
-    int32_t out_memsize_167;
-    struct memblock out_mem_166;
+    /* Byte offsets into the input and the per-group sums must fit in
+       the kernels' index type. */
+    if (sizeof(int32_t) * (scanned_size_263 + cl_num_groups * cl_group_size) >
+        INT32_MAX)
+        use_index64_kernels();
+    if (chunked_262) {
+        if (cl_debug)
+            fprintf(stderr,
+                    "Scanning %ld bytes out of core in chunks of %ld bytes.\n",
+                    (long) a_mem_size_135, (long) chunk_size_261);
+    } else if (!map_input && upload_chunk_size == 0) {
+        memblock_alloc_device(&a_mem_device_260, a_mem_size_135);
+        if (a_mem_size_135 > 0)
+            OPENCL_SUCCEED(clEnqueueWriteBuffer(fut_cl_queue,
+                                                a_mem_device_260.mem, CL_TRUE,
+                                                0, a_mem_size_135,
+                                                a_mem_136.mem + 0, 0, NULL,
+                                                NULL));
+    }
+    /* Chunked runs read the input from host memory, which may be the
+       input object or mapping. */
+    if (!chunked_262) {
+        release_shm_input();
+        if (expected_file != NULL)
+            read_expected(expected_file, " i32", sizeof(int32_t), read_int32,
+                          1);
+    }
     
-    out_mem_166.references = NULL;
+    int64_t out_memsize_167;
     
-    int32_t out_arrsize_168;
+    int64_t out_arrsize_168;
     
     if (perform_warmup) {
         time_runs = 0;
         t_start = get_wall_time();
-        main_ret_259 = futhark_main(a_mem_size_135, a_mem_device_260, size_37);
+        if (chunked_262)
+            main_ret_259 = futhark_main_chunked((int32_t *) a_mem_136.mem,
+                                                size_37, chunk_size_261);
+        else
+            main_ret_259 = futhark_main(a_mem_size_135, a_mem_device_260,
+                                        size_37);
         OPENCL_SUCCEED(clFinish(fut_cl_queue));
         t_end = get_wall_time();
         
@@ -2849,66 +6292,87 @@ int main(int argc, char **argv)
     for (int run = 0; run < num_runs; run++) {
         if (run == num_runs - 1)
             detail_timing = 1;
+        
+        int64_t creates_before = device_pool_creates;
+        int64_t slabs_before = refcount_slabs;
+        struct memory_run memory_run;
+        
+        memory_run_start(&memory_run);
         t_start = get_wall_time();
-        main_ret_259 = futhark_main(a_mem_size_135, a_mem_device_260, size_37);
+        if (chunked_262)
+            main_ret_259 = futhark_main_chunked((int32_t *) a_mem_136.mem,
+                                                size_37, chunk_size_261);
+        else
+            main_ret_259 = futhark_main(a_mem_size_135, a_mem_device_260,
+                                        size_37);
         OPENCL_SUCCEED(clFinish(fut_cl_queue));
         t_end = get_wall_time();
         
         long elapsed_usec = t_end - t_start;
         
+        if (cl_debug)
+            fprintf(stderr,
+                    "Run %d created %ld device buffers and %ld reference count slabs.\n",
+                    run, (long) (device_pool_creates - creates_before),
+                    (long) (refcount_slabs - slabs_before));
+        memory_run_end(&memory_run, run);
         if (time_runs && runtime_file != NULL)
             fprintf(runtime_file, "%ld\n", elapsed_usec);
         if (run < num_runs - 1) {
             memblock_unref_device(&main_ret_259.elem_1);
         }
     }
+    if (chunked_262) {
+        release_shm_input();
+        if (expected_file != NULL)
+            read_expected(expected_file, " i32", sizeof(int32_t), read_int32,
+                          1);
+    }
     memblock_unref(&a_mem_136);
     out_memsize_167 = main_ret_259.elem_0;
-    memblock_alloc(&out_mem_166, out_memsize_167);
-    if (out_memsize_167 > 0)
-        OPENCL_SUCCEED(clEnqueueReadBuffer(fut_cl_queue,
-                                           main_ret_259.elem_1.mem, CL_TRUE, 0,
-                                           out_memsize_167, out_mem_166.mem + 0,
-                                           0, NULL, NULL));
     out_arrsize_168 = main_ret_259.elem_2;
-    if (out_arrsize_168 == 0)
-        printf("empty(%s)", "i32");
-    else {
-        int print_i_261;
+    if (shm_output_name != NULL) {
+        int64_t shape[1] = {out_arrsize_168};
         
-        putchar('[');
-        for (print_i_261 = 0; print_i_261 < out_arrsize_168; print_i_261++) {
-            int32_t *print_elem_262 = (int32_t *) out_mem_166.mem +
-                    print_i_261 * 1;
-            
-            printf("%di32", *print_elem_262);
-            if (print_i_261 != out_arrsize_168 - 1)
-                printf(", ");
+        store_shm_output(shm_output_name, " i32", sizeof(int32_t),
+                         main_ret_259.elem_1.mem, shape, 1);
+    } else if (expected_file != NULL) {
+        int64_t shape[1] = {out_arrsize_168};
+        
+        verify_shape(shape, 1);
+        download_array(main_ret_259.elem_1.mem, out_memsize_167,
+                       sizeof(int32_t), verify_elems);
+        verify_end_int32(expected_file);
+    } else if (digest_output) {
+        int64_t shape[1] = {out_arrsize_168};
+        
+        digest_header(" i32", shape, 1);
+        download_array(main_ret_259.elem_1.mem, out_memsize_167,
+                       sizeof(int32_t), digest_elems);
+        output_digest();
+        output_flush();
+    } else {
+        int64_t shape[1] = {out_arrsize_168};
+        
+        if (binary_output) {
+            output_binary_header(" i32", shape, 1);
+            download_array(main_ret_259.elem_1.mem, out_memsize_167,
+                           sizeof(int32_t), output_binary_elems);
+        } else if (out_arrsize_168 == 0)
+            output_str("empty(i32)\n");
+        else {
+            output_str("[");
+            download_array(main_ret_259.elem_1.mem, out_memsize_167,
+                           sizeof(int32_t), output_int32_elems);
+            output_str("]\n");
         }
-        putchar(']');
+        output_flush();
     }
-    printf("\n");
     
     int total_runtime = 0;
     int total_runs = 0;
     
     if (cl_debug) {
-        fprintf(stderr,
-                "Kernel map_kernel_52                executed %6d times, with average runtime: %6ldus\tand total runtime: %6ldus\n",
-                map_kernel_52runs, (long) map_kernel_52total_runtime /
-                (map_kernel_52runs != 0 ? map_kernel_52runs : 1),
-                (long) map_kernel_52total_runtime);
-        total_runtime += map_kernel_52total_runtime;
-        total_runs += map_kernel_52runs;
-        fprintf(stderr,
-                "Kernel fut_kernel_map_transpose_i32 executed %6d times, with average runtime: %6ldus\tand total runtime: %6ldus\n",
-                fut_kernel_map_transpose_i32runs,
-                (long) fut_kernel_map_transpose_i32total_runtime /
-                (fut_kernel_map_transpose_i32runs !=
-                 0 ? fut_kernel_map_transpose_i32runs : 1),
-                (long) fut_kernel_map_transpose_i32total_runtime);
-        total_runtime += fut_kernel_map_transpose_i32total_runtime;
-        total_runs += fut_kernel_map_transpose_i32runs;
         fprintf(stderr,
                 "Kernel scan_kernel_62               executed %6d times, with average runtime: %6ldus\tand total runtime: %6ldus\n",
                 scan_kernel_62runs, (long) scan_kernel_62total_runtime /
@@ -2944,12 +6408,31 @@ int main(int argc, char **argv)
                 (long) map_kernel_104total_runtime);
         total_runtime += map_kernel_104total_runtime;
         total_runs += map_kernel_104runs;
+        fprintf(stderr,
+                "Kernel lookback_scan_kernel         executed %6d times, with average runtime: %6ldus\tand total runtime: %6ldus\n",
+                lookback_scan_kernelruns, (long) lookback_scan_kerneltotal_runtime /
+                (lookback_scan_kernelruns != 0 ? lookback_scan_kernelruns : 1),
+                (long) lookback_scan_kerneltotal_runtime);
+        total_runtime += lookback_scan_kerneltotal_runtime;
+        total_runs += lookback_scan_kernelruns;
+        fprintf(stderr,
+                "Kernel cpu_scan_kernel              executed %6d times, with average runtime: %6ldus\tand total runtime: %6ldus\n",
+                cpu_scan_kernelruns, (long) cpu_scan_kerneltotal_runtime /
+                (cpu_scan_kernelruns != 0 ? cpu_scan_kernelruns : 1),
+                (long) cpu_scan_kerneltotal_runtime);
+        total_runtime += cpu_scan_kerneltotal_runtime;
+        total_runs += cpu_scan_kernelruns;
     }
     if (cl_debug)
         fprintf(stderr, "Ran %d kernels with cumulative runtime: %6ldus\n",
                 total_runs, total_runtime);
     memblock_unref_device(&main_ret_259.elem_1);
+    if (cl_debug)
+        report_device_pool();
+    device_pool_trim(0);
     if (runtime_file != NULL)
         fclose(runtime_file);
+    if (output_fd != STDOUT_FILENO && close(output_fd) != 0)
+        panic(1, "Cannot write output: %s\n", strerror(errno));
     return 0;
 }